@@ -0,0 +1,99 @@
+#include <checkpoint.h>
+#include <placementlog.h>
+#include <sstream>
+#include <iterator>
+#include <cstdio>
+#include <zlib.h>
+
+// the text state of a mt19937 is 624 numbers, anything much longer is not one
+static const size_t MAX_RNG_BYTES = 1 << 16;
+
+std::string QuiltCheckpoint::key(const QuiltParams &_params, const std::vector<cv::Mat> &_sources)
+{
+    // the pruning is left out, the pruned search evaluates the same candidates exactly
+    std::ostringstream key;
+    key.precision(17);
+    key << _params.tilesize << " " << _params.overlap << " " << _params.num_tiles << " "
+        << _params.useconv << " " << _params.complex << " " << _params.kernels << " "
+        << _params.err << " " << _params.seed << " "
+        << _params.transforms << " " << _params.adaptive << " " << _params.split_threshold << " "
+        << _params.min_tilesize << " " << _params.coherence << " " << _params.coherence_radius << " "
+        << _params.coherence_random << " " << _params.coherence_threshold;
+
+    for(size_t e=0; e<_sources.size(); e++)
+    {
+        const cv::Mat &src = _sources[e];
+        uLong crc = crc32(0, Z_NULL, 0);
+        for(int r=0; r<src.rows; r++)
+        {
+            crc = crc32(crc, src.ptr<unsigned char>(r), src.cols*src.elemSize());
+        }
+        key << " " << src.rows << "x" << src.cols << "x" << src.channels() << ":" << std::hex << crc << std::dec;
+    }
+    return key.str();
+}
+
+bool QuiltCheckpoint::write(const std::string &_filename, const std::string &_key, int _rows,
+                            const std::string &_rng, const QuiltPlacement &_placement,
+                            const std::vector<cv::Mat> &_sources)
+{
+    std::string placement;
+    PlacementLog::encode(placement, _placement, _sources);
+
+    std::string tmp = _filename + ".tmp";
+    {
+        std::ofstream file(tmp.c_str(), std::ios::binary | std::ios::trunc);
+        file << "QCKP 1\n" << _key << "\n" << _rows << "\n" << _rng.size() << "\n" << _rng << "\n";
+        file.write(placement.data(), placement.size());
+        file.flush();
+        if(!file)
+        {
+            std::cerr << "QuiltCheckpoint::write() - cannot write " << tmp << std::endl;
+            return false;
+        }
+    }
+    if(std::rename(tmp.c_str(), _filename.c_str()) != 0)
+    {
+        std::cerr << "QuiltCheckpoint::write() - cannot rename " << tmp << " to " << _filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool QuiltCheckpoint::read(const std::string &_filename, const std::string &_key, int &_rows,
+                           std::string &_rng, QuiltPlacement &_placement, std::vector<cv::Size> &_sizes)
+{
+    std::ifstream file(_filename.c_str(), std::ios::binary);
+    if(!file)
+        return false;
+
+    std::string magic, key;
+    size_t rng_size = 0;
+    std::getline(file, magic);
+    std::getline(file, key);
+    file >> _rows >> rng_size;
+    file.get();
+    if( !file || (magic != "QCKP 1") || (rng_size > MAX_RNG_BYTES) )
+    {
+        std::cerr << "QuiltCheckpoint::read() - " << _filename << " is not a checkpoint" << std::endl;
+        return false;
+    }
+    if(key != _key)
+    {
+        std::cout << "checkpoint " << _filename << " is from another synthesis, starting over" << std::endl;
+        return false;
+    }
+
+    _rng.resize(rng_size);
+    file.read(&_rng[0], rng_size);
+    file.get();
+    std::string placement((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    int channels;
+    if( (rng_size == 0) || !PlacementLog::decode(placement, _placement, _sizes, channels) )
+    {
+        std::cerr << "QuiltCheckpoint::read() - " << _filename << " is damaged" << std::endl;
+        return false;
+    }
+    return true;
+}
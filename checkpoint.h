@@ -0,0 +1,42 @@
+/*
+ * Synthesis checkpoints
+ *
+ * A checkpoint records how far a synthesis got: the number of finished
+ * tile rows, the state of the random generator after them, and their
+ * placement. The pixels are not stored, the finished rows are rendered
+ * again from the placement on resume, so a checkpoint is a few bytes per
+ * tile and resuming gives the same output as an uninterrupted run.
+ *
+ * Layout:
+ *   QCKP 1\n
+ *   <key>\n                  parameters and a checksum of the sources
+ *   <rows>\n
+ *   <rng bytes>\n<rng state as written by operator<<>\n
+ *   placement log (see placementlog.h)
+ *
+ * Checkpoints are written to <file>.tmp and renamed, so a crash while
+ * writing leaves the previous one intact.
+ *
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <imagequilting.h>
+
+class QuiltCheckpoint
+{
+public:
+    // what a synthesis depends on, a checkpoint is only resumed with the same key
+    static std::string key(const QuiltParams &_params, const std::vector<cv::Mat> &_sources);
+
+    static bool write(const std::string &_filename, const std::string &_key, int _rows,
+                      const std::string &_rng, const QuiltPlacement &_placement,
+                      const std::vector<cv::Mat> &_sources);
+    // false without a message when there is no checkpoint or it has another key
+    static bool read(const std::string &_filename, const std::string &_key, int &_rows,
+                     std::string &_rng, QuiltPlacement &_placement, std::vector<cv::Size> &_sizes);
+};
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,274 @@
+#include <costmodel.h>
+#include <algorithm>
+#include <sstream>
+#include <fstream>
+// for loading parameters from xml
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+CostModel::CostModel()
+    : max_seconds(0), max_bytes(0), parallel_fraction(0)
+{
+    // uncalibrated defaults, run quiltbench to fit them to this machine
+    time_coeffs[0] = 1e-2;      // fixed cost
+    time_coeffs[1] = 1.5e-7;    // convolution search, per source pixel and channel
+    time_coeffs[2] = 3e-5;      // brute force search, per candidate
+    time_coeffs[3] = 5e-9;      // brute force search, per compared pixel
+    time_coeffs[4] = 1e-7;      // tile write, per pixel
+    time_coeffs[5] = 2e-8;      // mincut
+    memory_coeffs[0] = 50e6;    // process baseline
+    memory_coeffs[1] = 1;       // source image
+    memory_coeffs[2] = 1;       // output image
+    memory_coeffs[3] = 6;       // double planes of the convolution search
+    memory_coeffs[4] = 3;       // distance map
+}
+
+void CostModel::time_features(int _rows, int _cols, int _channels, const QuiltParams &_params, double *_f)
+{
+    double n = (double)_params.num_tiles*_params.num_tiles;
+    double ts = _params.tilesize;
+    double ov = _params.overlap;
+    double positions = std::max(0.0, (double)(_rows-_params.tilesize)*(_cols-_params.tilesize));
+    // every transform is a search of its own
+    double searches = n*(_params.transforms ? 8 : 1);
+
+    _f[0] = 1;
+    _f[1] = _params.useconv ? searches*_rows*_cols*_channels : 0;
+    _f[2] = _params.useconv ? 0 : searches*positions;
+    _f[3] = _params.useconv ? 0 : searches*positions*ts*ts*_channels;
+    _f[4] = n*ts*ts*_channels;
+    // the back trace of mincut is quadratic in the overlap width
+    _f[5] = _params.complex ? n*ts*ov*ov : 0;
+}
+
+void CostModel::memory_features(int _rows, int _cols, int _channels, const QuiltParams &_params, double *_f)
+{
+    double destsize = ImageQuilting::output_size(_params);
+    double positions = std::max(0.0, (double)(_rows-_params.tilesize)*(_cols-_params.tilesize));
+
+    _f[0] = 1;
+    _f[1] = (double)_rows*_cols*_channels;
+    _f[2] = destsize*destsize*_channels;
+    _f[3] = _params.useconv ? (double)_rows*_cols*_channels*sizeof(double) : 0;
+    _f[4] = positions*sizeof(double)*(_params.transforms ? 8 : 1);
+}
+
+CostEstimate CostModel::estimate(int _rows, int _cols, int _channels, const QuiltParams &_params, int _threads) const
+{
+    double ft[NUM_TIME_FEATURES], fm[NUM_MEMORY_FEATURES];
+    time_features(_rows, _cols, _channels, _params, ft);
+    memory_features(_rows, _cols, _channels, _params, fm);
+
+    CostEstimate e;
+    e.seconds = 0;
+    e.bytes = 0;
+    for(int k=0; k<NUM_TIME_FEATURES; k++)
+    {
+        e.seconds += time_coeffs[k]*ft[k];
+    }
+    for(int k=0; k<NUM_MEMORY_FEATURES; k++)
+    {
+        e.bytes += memory_coeffs[k]*fm[k];
+    }
+
+    // Amdahl's law for the part of the run that scales with threads
+    int threads = std::max(1, _threads);
+    e.seconds *= (1-parallel_fraction) + parallel_fraction/threads;
+    return e;
+}
+
+AdmissionDecision CostModel::admit(int _rows, int _cols, int _channels, QuiltParams &_params, int _threads, CostEstimate &_estimate) const
+{
+    struct Limits
+    {
+        double s, b;
+        bool fits(const CostEstimate &_e) const
+        {
+            return ((s <= 0) || (_e.seconds <= s)) && ((b <= 0) || (_e.bytes <= b));
+        }
+    } limits = { max_seconds, max_bytes };
+
+    _estimate = estimate(_rows, _cols, _channels, _params, _threads);
+    if(limits.fits(_estimate))
+        return ADMIT_ACCEPT;
+
+    // downgrades keep the output size, first the convolution search, then drop mincut
+    QuiltParams p = _params;
+    for(int step=0; step<2; step++)
+    {
+        if(step == 0)
+        {
+            if(p.useconv)
+                continue;
+            p.useconv = true;
+        }
+        else
+        {
+            if(!p.complex)
+                continue;
+            p.complex = false;
+        }
+
+        CostEstimate e = estimate(_rows, _cols, _channels, p, _threads);
+        if(limits.fits(e))
+        {
+            _params = p;
+            _estimate = e;
+            return ADMIT_DOWNGRADE;
+        }
+    }
+    return ADMIT_REJECT;
+}
+
+void CostModel::calibrate(const std::vector<CostSample> &_samples)
+{
+    // weighted least squares, every row is divided by its measurement so the
+    // fit minimises the relative error instead of being dominated by long runs
+    cv::Mat At, bt, Am, bm;
+    for(size_t s=0; s<_samples.size(); s++)
+    {
+        const CostSample &cs = _samples[s];
+
+        if( (cs.threads <= 1) && (cs.seconds > 0) )
+        {
+            cv::Mat row(1, NUM_TIME_FEATURES, CV_64F);
+            time_features(cs.rows, cs.cols, cs.channels, cs.params, row.ptr<double>(0));
+            At.push_back(cv::Mat(row/cs.seconds));
+            bt.push_back(cv::Mat(cv::Mat::ones(1, 1, CV_64F)));
+        }
+        if(cs.bytes > 0)
+        {
+            cv::Mat row(1, NUM_MEMORY_FEATURES, CV_64F);
+            memory_features(cs.rows, cs.cols, cs.channels, cs.params, row.ptr<double>(0));
+            Am.push_back(cv::Mat(row/cs.bytes));
+            bm.push_back(cv::Mat(cv::Mat::ones(1, 1, CV_64F)));
+        }
+    }
+
+    cv::Mat x;
+    if(!At.empty() && cv::solve(At, bt, x, cv::DECOMP_SVD))
+    {
+        for(int k=0; k<NUM_TIME_FEATURES; k++)
+        {
+            time_coeffs[k] = std::max(0.0, x.at<double>(k));
+        }
+    }
+    if(!Am.empty() && cv::solve(Am, bm, x, cv::DECOMP_SVD))
+    {
+        for(int k=0; k<NUM_MEMORY_FEATURES; k++)
+        {
+            memory_coeffs[k] = std::max(0.0, x.at<double>(k));
+        }
+    }
+
+    // the multi threaded runs give the parallel fraction through their speedup
+    double sum = 0;
+    int count = 0;
+    parallel_fraction = 0;
+    for(size_t s=0; s<_samples.size(); s++)
+    {
+        const CostSample &cs = _samples[s];
+        if( (cs.threads <= 1) || (cs.seconds <= 0) )
+            continue;
+
+        double serial = estimate(cs.rows, cs.cols, cs.channels, cs.params, 1).seconds;
+        double speedup = serial/cs.seconds;
+        sum += (1 - 1/speedup)/(1 - 1.0/cs.threads);
+        count++;
+    }
+    if(count > 0)
+    {
+        parallel_fraction = std::min(1.0, std::max(0.0, sum/count));
+    }
+}
+
+bool CostModel::load(const std::string &_filename)
+{
+    boost::property_tree::ptree tree;
+    try
+    {
+        boost::property_tree::read_xml(_filename, tree);
+    }
+    catch(const boost::property_tree::xml_parser_error &e)
+    {
+        std::cerr << "CostModel::load() - " << e.what() << std::endl;
+        return false;
+    }
+
+    for(int k=0; k<NUM_TIME_FEATURES; k++)
+    {
+        std::ostringstream key;
+        key << "image_quilting.cost_model.time.c" << k;
+        time_coeffs[k] = tree.get<double>(key.str(), time_coeffs[k]);
+    }
+    for(int k=0; k<NUM_MEMORY_FEATURES; k++)
+    {
+        std::ostringstream key;
+        key << "image_quilting.cost_model.memory.m" << k;
+        memory_coeffs[k] = tree.get<double>(key.str(), memory_coeffs[k]);
+    }
+    parallel_fraction = tree.get<double>("image_quilting.cost_model.parallel_fraction", parallel_fraction);
+
+    max_seconds = tree.get<double>("image_quilting.admission.max_seconds", max_seconds);
+    max_bytes = tree.get<double>("image_quilting.admission.max_megabytes", max_bytes/1e6)*1e6;
+    return true;
+}
+
+bool CostModel::save(const std::string &_filename)
+{
+    boost::property_tree::ptree tree;
+    bool crlf = false;
+    try
+    {
+        // without no_comments the comments are kept as <xmlcomment> nodes and written back
+        boost::property_tree::read_xml(_filename, tree, boost::property_tree::xml_parser::trim_whitespace);
+
+        std::ifstream file(_filename.c_str(), std::ios::binary);
+        std::string line;
+        crlf = std::getline(file, line) && !line.empty() && (line[line.size()-1] == '\r');
+    }
+    catch(const boost::property_tree::xml_parser_error &)
+    {
+        // start a new file
+    }
+
+    for(int k=0; k<NUM_TIME_FEATURES; k++)
+    {
+        std::ostringstream key;
+        key << "image_quilting.cost_model.time.c" << k;
+        tree.put(key.str(), time_coeffs[k]);
+    }
+    for(int k=0; k<NUM_MEMORY_FEATURES; k++)
+    {
+        std::ostringstream key;
+        key << "image_quilting.cost_model.memory.m" << k;
+        tree.put(key.str(), memory_coeffs[k]);
+    }
+    tree.put("image_quilting.cost_model.parallel_fraction", parallel_fraction);
+
+    std::ostringstream xml;
+    boost::property_tree::write_xml(xml, tree, boost::property_tree::xml_writer_make_settings<std::string>('\t', 1));
+
+    // keep the line endings of the file
+    std::string out = xml.str();
+    if(crlf)
+    {
+        std::string converted;
+        for(size_t k=0; k<out.size(); k++)
+        {
+            if(out[k] == '\n')
+                converted.push_back('\r');
+            converted.push_back(out[k]);
+        }
+        out.swap(converted);
+    }
+
+    std::ofstream file(_filename.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(out.data(), out.size());
+    if(!file)
+    {
+        std::cerr << "CostModel::save() - cannot write " << _filename << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,76 @@
+/*
+ * Runtime and memory cost model
+ *
+ * Predicts wall time and peak memory of a synthesis from the source size
+ * and the parameters, before synthesize() starts. The coefficients are
+ * fitted by quiltbench and stored in parameters.xml. Admission control
+ * compares the prediction with configured limits and accepts, downgrades
+ * or rejects the job.
+ *
+ */
+
+#ifndef COSTMODEL_H
+#define COSTMODEL_H
+
+#include <string>
+#include <vector>
+#include <imagequilting.h>
+
+struct CostEstimate
+{
+    double seconds;
+    double bytes;
+};
+
+// one measured run, as recorded by quiltbench
+struct CostSample
+{
+    int rows;
+    int cols;
+    int channels;
+    QuiltParams params;
+    int threads;
+    double seconds;
+    double bytes;
+};
+
+enum AdmissionDecision
+{
+    ADMIT_ACCEPT,
+    ADMIT_DOWNGRADE,
+    ADMIT_REJECT
+};
+
+class CostModel
+{
+public:
+    enum { NUM_TIME_FEATURES = 6, NUM_MEMORY_FEATURES = 5 };
+
+    CostModel();
+
+    // read the <cost_model> and <admission> sections, missing keys keep the defaults
+    bool load(const std::string &_filename);
+    // write the fitted <cost_model> section back, the rest of the file is kept
+    bool save(const std::string &_filename);
+
+    CostEstimate estimate(int _rows, int _cols, int _channels, const QuiltParams &_params, int _threads) const;
+
+    // decide whether a job fits in the limits, _params is changed in place on a downgrade
+    AdmissionDecision admit(int _rows, int _cols, int _channels, QuiltParams &_params, int _threads, CostEstimate &_estimate) const;
+
+    // least squares fit of the coefficients to benchmark runs
+    void calibrate(const std::vector<CostSample> &_samples);
+
+    double max_seconds;      // 0 disables the limit
+    double max_bytes;        // 0 disables the limit
+
+private:
+    static void time_features(int _rows, int _cols, int _channels, const QuiltParams &_params, double *_f);
+    static void memory_features(int _rows, int _cols, int _channels, const QuiltParams &_params, double *_f);
+
+    double time_coeffs[NUM_TIME_FEATURES];
+    double memory_coeffs[NUM_MEMORY_FEATURES];
+    double parallel_fraction;   // Amdahl fraction of the run that scales with threads
+};
+
+#endif // COSTMODEL_H
@@ -0,0 +1,23 @@
+#-------------------------------------------------
+#
+# Project created by QtCreator 2017-06-30T15:34:06
+#
+#-------------------------------------------------
+
+QT       += core gui
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets concurrent
+
+TARGET = image_quilting
+TEMPLATE = app
+
+include(quiltcore.pri)
+
+SOURCES += main.cpp\
+    io.cpp
+
+HEADERS  += io.h
+
+FORMS    +=
+
+CONFIG += c++11
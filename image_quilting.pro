@@ -4,25 +4,15 @@
 #
 #-------------------------------------------------
 
-QT       += core gui
-
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
-
-TARGET = image_quilting
-TEMPLATE = app
-
-INCLUDEPATH += /home/kevin/research/texture/image_quilting/ext
-
-INCLUDEPATH += /usr/local/opencv-2-4-10/include
-LIBS += -L/usr/local/opencv-2-4-10/lib -lopencv_core -lopencv_highgui -lopencv_imgproc
-
-SOURCES += main.cpp\
-        imagequilting.cpp \
-    io.cpp
-
-HEADERS  += imagequilting.h \
-    io.h
-
-FORMS    +=
-
-CONFIG += c++11
+TEMPLATE = subdirs
+
+# Qt-free synthesis library, and the Qt form, daemon and benchmarks on top of it
+SUBDIRS = quiltcore gui quiltd quiltbench
+
+quiltcore.file = quiltcore.pro
+gui.file = gui.pro
+gui.depends = quiltcore
+quiltd.file = quiltd.pro
+quiltd.depends = quiltcore
+quiltbench.file = quiltbench.pro
+quiltbench.depends = quiltcore
@@ -1,7 +1,13 @@
 #include <imagequilting.h>
+#include <kernels.h>
+#include <placementlog.h>
+#include <checkpoint.h>
+#include <sstream>
+#include <cstdio>
 #include <valarray>
 #include <algorithm>
 #include <cstdlib>
+#include <limits>
 // for loading parameters from xml
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/xml_parser.hpp>
@@ -9,374 +15,1738 @@
 
 using namespace cv;
 
+// dihedral transform t of a square image: rotate t&3 quarter turns clockwise,
+// then mirror left to right if t&4
+static void dihedral(const cv::Mat &src, cv::Mat &dst, int _t)
+{
+    cv::Mat rotated;
+    switch(_t & 3)
+    {
+        case 0: rotated = src; break;
+        case 1: cv::transpose(src, rotated); cv::flip(rotated, rotated, 1); break;
+        case 2: cv::flip(src, rotated, -1); break;
+        case 3: cv::transpose(src, rotated); cv::flip(rotated, rotated, 0); break;
+    }
+    if(_t & 4)
+    {
+        cv::flip(rotated, dst, 1);
+    }
+    else
+    {
+        dst = rotated;
+    }
+}
+
+// where pixel p of a _size X _size image ends up under transform t
+static cv::Point dihedral_point(const cv::Point &p, int _size, int _t)
+{
+    int n = _size-1;
+    cv::Point q;
+    switch(_t & 3)
+    {
+        case 0: q = p; break;
+        case 1: q = cv::Point(n-p.y, p.x); break;
+        case 2: q = cv::Point(n-p.x, n-p.y); break;
+        case 3: q = cv::Point(p.y, n-p.x); break;
+    }
+    if(_t & 4)
+    {
+        q.x = n-q.x;
+    }
+    return q;
+}
+
+static cv::Rect dihedral_rect(const cv::Rect &R, int _size, int _t)
+{
+    cv::Point a = dihedral_point(R.tl(), _size, _t);
+    cv::Point b = dihedral_point(R.br() - cv::Point(1,1), _size, _t);
+    return cv::Rect(cv::Point(std::min(a.x,b.x), std::min(a.y,b.y)),
+                    cv::Point(std::max(a.x,b.x)+1, std::max(a.y,b.y)+1));
+}
+
+// the mirrored transforms are their own inverse, rotations turn back
+static int dihedral_inverse(int _t)
+{
+    return (_t & 4) ? _t : (4-_t) % 4;
+}
+
+// runs body(k) for every k of a range on OpenCV's thread pool
+class ParallelIndex : public cv::ParallelLoopBody
+{
+public:
+    explicit ParallelIndex(const std::function<void(int)> &_body) : body(_body) {}
+
+    void operator()(const cv::Range &_range) const
+    {
+        for(int k=_range.start; k<_range.end; k++)
+        {
+            body(k);
+        }
+    }
+
+private:
+    std::function<void(int)> body;
+};
+
 ImageQuilting::ImageQuilting()
 {
 }
 
-ImageQuilting::~ImageQuilting()
+ImageQuilting::~ImageQuilting()
+{
+}
+
+int ImageQuilting::output_size(const QuiltParams &params)
+{
+    return params.num_tiles*params.tilesize - (params.num_tiles-1)*params.overlap;
+}
+
+bool ImageQuilting::synthesize(const QuiltBuffer &imgin, QuiltBuffer &imgout, const QuiltParams &params, QuiltProgress progress)
+{
+    int destsize = output_size(params);
+    if( (imgin.data == NULL) || (imgout.data == NULL) )
+    {
+        std::cerr << "ImageQuilting::synthesize() - empty buffer" << std::endl;
+        return false;
+    }
+    if( (imgout.width != destsize) || (imgout.height != destsize) || (imgout.channels != imgin.channels) )
+    {
+        std::cerr << "ImageQuilting::synthesize() - output buffer must be " << destsize << " X " << destsize << " X " << imgin.channels << std::endl;
+        return false;
+    }
+
+    // wrap the caller's buffers, no pixel data is copied
+    cv::Mat in(imgin.height, imgin.width, CV_8UC(imgin.channels), imgin.data, imgin.step);
+    cv::Mat out(imgout.height, imgout.width, CV_8UC(imgout.channels), imgout.data, imgout.step);
+    return synthesize(in, out, params, progress);
+}
+
+bool ImageQuilting::synthesize(const cv::Mat &imgin, cv::Mat &imgout, const QuiltParams &params, QuiltProgress progress)
+{
+    return synthesize(std::vector<cv::Mat>(1, imgin), imgout, params, progress);
+}
+
+bool ImageQuilting::synthesize(const std::vector<QuiltBuffer> &imgin, QuiltBuffer &imgout, const QuiltParams &params, QuiltProgress progress)
+{
+    int destsize = output_size(params);
+    if( imgin.empty() || (imgout.data == NULL) )
+    {
+        std::cerr << "ImageQuilting::synthesize() - empty buffer" << std::endl;
+        return false;
+    }
+    if( (imgout.width != destsize) || (imgout.height != destsize) || (imgout.channels != imgin[0].channels) )
+    {
+        std::cerr << "ImageQuilting::synthesize() - output buffer must be " << destsize << " X " << destsize << " X " << imgin[0].channels << std::endl;
+        return false;
+    }
+
+    std::vector<cv::Mat> in;
+    for(size_t e=0; e<imgin.size(); e++)
+    {
+        if(imgin[e].data == NULL)
+        {
+            std::cerr << "ImageQuilting::synthesize() - empty buffer" << std::endl;
+            return false;
+        }
+        in.push_back(cv::Mat(imgin[e].height, imgin[e].width, CV_8UC(imgin[e].channels), imgin[e].data, imgin[e].step));
+    }
+    cv::Mat out(imgout.height, imgout.width, CV_8UC(imgout.channels), imgout.data, imgout.step);
+    return synthesize(in, out, params, progress);
+}
+
+bool ImageQuilting::synthesize(const std::vector<cv::Mat> &imgin, cv::Mat &imgout, const QuiltParams &params, QuiltProgress progress)
+{
+    if(!prepare(imgin, imgout, params))
+        return false;
+
+    rng.seed(params.seed);
+    if(!params.checkpoint.empty())
+    {
+        m_checkpoint = params.checkpoint;
+        m_checkpoint_rows = std::max(1, params.checkpoint_rows);
+        m_checkpoint_key = QuiltCheckpoint::key(params, imgin);
+        resume();
+    }
+    // a cancelled run keeps its checkpoint
+    if(!run(progress))
+        return false;
+
+    if(!m_checkpoint.empty())
+    {
+        std::remove(m_checkpoint.c_str());
+    }
+    if( !params.placement_log.empty() && !PlacementLog::write(params.placement_log, placement, imgin) )
+        return false;
+    return true;
+}
+
+// continue after the tile rows of the checkpoint: they are rendered from their placement
+// and the generator is where it was after them, so the rest is searched as before
+bool ImageQuilting::resume()
+{
+    int rows;
+    std::string state;
+    QuiltPlacement saved;
+    std::vector<cv::Size> sizes;
+    if(!QuiltCheckpoint::read(m_checkpoint, m_checkpoint_key, rows, state, saved, sizes))
+        return false;
+
+    bool valid = (rows > 0) && (rows < num_tiles) && (saved.tilesize == tilesize) && (saved.overlap == overlap) &&
+                 (saved.num_tiles == num_tiles) && (sizes.size() == exemplars.size());
+    for(int k=0; valid && (k<rows*num_tiles); k++)
+    {
+        valid = valid_tile(saved.tiles[k], tilesize);
+    }
+    std::istringstream in(state);
+    std::mt19937 saved_rng;
+    in >> saved_rng;
+    if( !valid || !in )
+    {
+        std::cerr << "ImageQuilting::resume() - " << m_checkpoint << " does not fit this synthesis, starting over" << std::endl;
+        return false;
+    }
+
+    for(int i=0; i<rows; i++)
+    {
+        for(int j=0; j<num_tiles; j++)
+        {
+            placement.tiles[i*num_tiles+j] = saved.tiles[i*num_tiles+j];
+            set_tile(i, j);
+            paste_tile(placement.tiles[i*num_tiles+j]);
+        }
+    }
+    rng = saved_rng;
+    m_first_row = rows;
+    std::cout << "resuming after " << rows << " of " << num_tiles << " tile rows" << std::endl;
+    return true;
+}
+
+// called after tile row _i, the last row is not saved since the run ends with it
+void ImageQuilting::checkpoint_row(int _i)
+{
+    if( m_checkpoint.empty() || ((_i+1) % m_checkpoint_rows != 0) || (_i+1 >= num_tiles) )
+        return;
+
+    std::vector<cv::Mat> sources;
+    for(size_t e=0; e<exemplars.size(); e++)
+    {
+        sources.push_back(exemplars[e].image);
+    }
+    std::ostringstream state;
+    state << rng;
+
+    // a failed checkpoint does not stop the synthesis
+    QuiltCheckpoint::write(m_checkpoint, m_checkpoint_key, _i+1, state.str(), placement, sources);
+}
+
+bool ImageQuilting::render(const cv::Mat &imgin, const QuiltPlacement &_placement, cv::Mat &imgout)
+{
+    return render(std::vector<cv::Mat>(1, imgin), _placement, imgout);
+}
+
+bool ImageQuilting::render(const std::vector<cv::Mat> &imgin, const QuiltPlacement &_placement, cv::Mat &imgout)
+{
+    // nothing is searched, skip the preparation of the source for the search
+    QuiltParams params;
+    params.tilesize = _placement.tilesize;
+    params.overlap = _placement.overlap;
+    params.num_tiles = _placement.num_tiles;
+    params.useconv = false;
+    params.prune = false;
+    if(!prepare(imgin, imgout, params))
+        return false;
+
+    bool valid = (_placement.tiles.size() == placement.tiles.size());
+    for(size_t k=0; valid && (k<_placement.tiles.size()); k++)
+    {
+        valid = valid_tile(_placement.tiles[k], tilesize);
+    }
+    if(!valid)
+    {
+        std::cerr << "ImageQuilting::render() - placement does not fit the sources" << std::endl;
+        return false;
+    }
+
+    placement = _placement;
+    for(int i=0; i<num_tiles; i++)
+    {
+        for(int j=0; j<num_tiles; j++)
+        {
+            set_tile(i, j);
+            paste_tile(placement.tiles[i*num_tiles+j]);
+        }
+    }
+    return true;
+}
+
+bool ImageQuilting::render(const cv::Mat &imgin, const std::string &_log, cv::Mat &imgout)
+{
+    return render(std::vector<cv::Mat>(1, imgin), _log, imgout);
+}
+
+bool ImageQuilting::render(const std::vector<cv::Mat> &imgin, const std::string &_log, cv::Mat &imgout)
+{
+    QuiltPlacement log;
+    std::vector<cv::Size> sizes;
+    int channels;
+    if(!PlacementLog::read(_log, log, sizes, channels))
+        return false;
+
+    bool same = (sizes.size() == imgin.size());
+    for(size_t e=0; same && (e<imgin.size()); e++)
+    {
+        same = (imgin[e].size() == sizes[e]) && (imgin[e].channels() == channels);
+    }
+    if(!same)
+    {
+        std::cerr << "ImageQuilting::render() - " << _log << " was made from other sources" << std::endl;
+        return false;
+    }
+    return render(imgin, log, imgout);
+}
+
+bool ImageQuilting::synthesize_frame(const QuiltBuffer &imgin, QuiltBuffer &imgout, const QuiltParams &params, QuiltSequence &sequence, QuiltProgress progress)
+{
+    int destsize = output_size(params);
+    if( (imgin.data == NULL) || (imgout.data == NULL) ||
+        (imgout.width != destsize) || (imgout.height != destsize) || (imgout.channels != imgin.channels) )
+    {
+        std::cerr << "ImageQuilting::synthesize_frame() - output buffer must be " << destsize << " X " << destsize << " X " << imgin.channels << std::endl;
+        return false;
+    }
+
+    cv::Mat in(imgin.height, imgin.width, CV_8UC(imgin.channels), imgin.data, imgin.step);
+    cv::Mat out(imgout.height, imgout.width, CV_8UC(imgout.channels), imgout.data, imgout.step);
+    return synthesize_frame(in, out, params, sequence, progress);
+}
+
+bool ImageQuilting::synthesize_frame(const cv::Mat &imgin, cv::Mat &imgout, const QuiltParams &params, QuiltSequence &sequence, QuiltProgress progress)
+{
+    // the previous frame is only usable if it was quilted on the same grid
+    int destsize = output_size(params);
+    bool warm = (sequence.placement.tilesize == params.tilesize) &&
+                (sequence.placement.overlap == params.overlap) &&
+                (sequence.placement.num_tiles == params.num_tiles) &&
+                (sequence.previous.rows == destsize) && (sequence.previous.cols == destsize) &&
+                (sequence.previous.type() == imgin.type()) &&
+                !params.adaptive && !has_splits(sequence.placement);
+
+    if(!prepare(imgin, imgout, params))
+        return false;
+
+    rng.seed(params.seed + sequence.frame);
+    if( !(warm ? run_frame(sequence, progress) : run(progress)) )
+        return false;
+
+    sequence.placement = placement;
+    output_image.copyTo(sequence.previous);
+    sequence.frame++;
+    return true;
+}
+
+bool ImageQuilting::resynthesize(const cv::Mat &imgin, const cv::Mat &previous, const QuiltPlacement &last, cv::Mat &imgout, const QuiltParams &params, const cv::Rect &region, QuiltProgress progress)
+{
+    int m = last.num_tiles;
+    QuiltParams last_params = params;
+    last_params.num_tiles = m;
+    int last_size = output_size(last_params);
+
+    if( (last.tilesize != params.tilesize) || (last.overlap != params.overlap) || ((int)last.tiles.size() != m*m) ||
+        (previous.rows != last_size) || (previous.cols != last_size) || (previous.type() != imgin.type()) ||
+        params.adaptive || has_splits(last) || !single_exemplar(last) )
+    {
+        std::cerr << "ImageQuilting::resynthesize() - previous result does not match, synthesizing from scratch" << std::endl;
+        return synthesize(imgin, imgout, params, progress);
+    }
+
+    // previous may share its data with imgout
+    cv::Mat kept = previous.clone();
+    if(!prepare(imgin, imgout, params))
+        return false;
+    rng.seed(params.seed);
+
+    int n = num_tiles;
+    std::vector<char> search(n*n, 0), reseam(n*n, 0), redo(n*n, 0), replay(n*n, 0);
+
+    // tiles the previous grid did not have, and the re-rolled region, get a new search
+    for(int i=0; i<n; i++)
+    {
+        for(int j=0; j<n; j++)
+        {
+            search[i*n+j] = (i>=m) || (j>=m) || region.contains(cv::Point(j,i));
+        }
+    }
+
+    // tiles cut against a searched tile keep their source but get new seams,
+    // tiles whose right or bottom neighbour was dropped have their pixels rebuilt
+    for(int i=0; i<n; i++)
+    {
+        for(int j=0; j<n; j++)
+        {
+            int k = i*n+j;
+            if(!search[k])
+            {
+                reseam[k] = ((j>0) && search[k-1]) ||
+                            ((i>0) && search[k-n]) ||
+                            ((i>0) && (j>0) && search[k-n-1]) ||
+                            ((i>0) && (j<n-1) && search[k-n+1]);
+            }
+            redo[k] = search[k] || reseam[k] || ((n<m) && ((i==n-1) || (j==n-1)));
+        }
+    }
+
+    // every tile overlapping a rebuilt tile is pasted again in raster order, so the
+    // rebuilt tiles see the same overlaps as in a synthesis from scratch
+    for(int i=0; i<n; i++)
+    {
+        for(int j=0; j<n; j++)
+        {
+            if(!redo[i*n+j])
+                continue;
+            for(int a=std::max(0,i-1); a<=std::min(n-1,i+1); a++)
+            {
+                for(int b=std::max(0,j-1); b<=std::min(n-1,j+1); b++)
+                {
+                    replay[a*n+b] = 1;
+                }
+            }
+        }
+    }
+
+    // start from the previous result with the rebuilt tiles cleared
+    int common = std::min(last_size, output_image.rows);
+    kept(Rect(0,0,common,common)).copyTo(output_image(Rect(0,0,common,common)));
+    output_image.copyTo(kept);
+
+    cv::Mat rebuilt = cv::Mat::zeros(output_image.rows, output_image.cols, CV_8U);
+    int total = 0;
+    for(int i=0; i<n; i++)
+    {
+        for(int j=0; j<n; j++)
+        {
+            int k = i*n+j;
+            if( (i<m) && (j<m) )
+            {
+                placement.tiles[k] = last.tiles[i*m+j];
+            }
+            if(redo[k])
+            {
+                set_tile(i, j);
+                rebuilt(Rect(startJ,startI,tilesize,tilesize)).setTo(cv::Scalar::all(255));
+                output_image(Rect(startJ,startI,tilesize,tilesize)).setTo(cv::Scalar::all(0));
+            }
+            total += replay[k];
+        }
+    }
+
+    int done = 0, searched = 0;
+    for(int i=0; i<n; i++)
+    {
+        for(int j=0; j<n; j++)
+        {
+            int k = i*n+j;
+            if(!replay[k])
+                continue;
+
+            TilePlacement &tile = placement.tiles[k];
+            set_tile(i, j);
+            if(search[k])
+            {
+                std::cout << "[i,j] = [" << i << "," << j << "]" << std::endl;
+                std::vector<cv::Mat> distances = tile_distances(i>0, j>0);
+                pick_tile(distances, tile, m_transforms);
+                compute_seams(i>0, j>0, tile);
+                searched++;
+            }
+            else if(reseam[k])
+            {
+                compute_seams(i>0, j>0, tile);
+            }
+            paste_tile(tile);
+
+            if(!finish_tile(++done, total, progress))
+                return false;
+        }
+    }
+
+    // outside the rebuilt tiles the replay only restored context, keep the old pixels there
+    kept.copyTo(output_image, rebuilt==0);
+    std::cout << "DONE! searched " << searched << " of " << n*n << " tiles" << std::endl;
+
+    return true;
+}
+
+bool ImageQuilting::fill(const cv::Mat &image, const cv::Mat &mask, cv::Mat &imgout, const QuiltParams &params, QuiltProgress progress)
+{
+    if( (mask.type() != CV_8UC1) || (mask.size() != image.size()) )
+    {
+        std::cerr << "ImageQuilting::fill() - mask must be 8-bit with one channel and the size of the image" << std::endl;
+        return false;
+    }
+    if(cv::countNonZero(mask) == 0)
+    {
+        image.copyTo(imgout);
+        return true;
+    }
+
+    // search the part of the image around the mask only, so the cost follows the
+    // masked area; a region too small for a tile searches the whole image
+    std::vector<cv::Point> damaged;
+    cv::findNonZero(mask, damaged);
+    cv::Rect hole = cv::boundingRect(damaged);
+    cv::Rect region(hole.tl() - cv::Point(params.fill_margin, params.fill_margin),
+                    hole.br() + cv::Point(params.fill_margin, params.fill_margin));
+    region &= cv::Rect(0, 0, image.cols, image.rows);
+    if( (params.fill_margin <= 0) || (region.width <= params.tilesize) || (region.height <= params.tilesize) )
+    {
+        region = cv::Rect(0, 0, image.cols, image.rows);
+    }
+
+    // run_fill() has its own search over the known pixels of a tile, the preparation
+    // for the others is not needed
+    QuiltParams fill_params = params;
+    fill_params.num_tiles = 1;
+    fill_params.useconv = false;
+    fill_params.prune = false;
+    fill_params.adaptive = false;
+
+    // imgout may be image, keep the source apart from the output
+    cv::Mat source = image(region).clone();
+    cv::Mat scratch;
+    if(!prepare(source, scratch, fill_params))
+        return false;
+
+    image.copyTo(imgout);
+    imgout.setTo(cv::Scalar::all(0), mask);
+    output_image = imgout;
+
+    rng.seed(params.seed);
+    return run_fill(mask, region, progress);
+}
+
+// the planes in double precision and the integral image of the squared pixels, for the
+// correlation based ssd
+static void prepare_planes(QuiltExemplar &_src)
+{
+    cv::split(_src.image, _src.planes);
+    for(size_t k=0; k<_src.planes.size(); k++)
+    {
+        _src.planes[k].convertTo(_src.planes[k], CV_64F, 1, 0);
+    }
+    _src.plane_squares.resize(_src.planes.size());
+    for(size_t k=0; k<_src.planes.size(); k++)
+    {
+        cv::pow(_src.planes[k], 2, _src.plane_squares[k]);
+    }
+    cv::Mat squares;
+    select_square_sum(_src.image.channels())(_src.image, squares);
+    cv::integral(squares, _src.sqsum, CV_64F);
+}
+
+bool ImageQuilting::prepare(const cv::Mat &imgin, cv::Mat &imgout, const QuiltParams &params)
+{
+    return prepare(std::vector<cv::Mat>(1, imgin), imgout, params);
+}
+
+bool ImageQuilting::prepare(const std::vector<cv::Mat> &imgin, cv::Mat &imgout, const QuiltParams &params)
+{
+    if(imgin.empty())
+    {
+        std::cerr << "ImageQuilting::synthesize() - no source image" << std::endl;
+        return false;
+    }
+
+    // the synthesis runs natively on 1, 3 or 4 channels, alpha is searched and cut like the colours
+    int cn = imgin[0].channels();
+    if( (imgin[0].depth() != CV_8U) || ((cn != 1) && (cn != 3) && (cn != 4)) )
+    {
+        std::cerr << "ImageQuilting::synthesize() - unsupported image type, need 8-bit with 1, 3 or 4 channels" << std::endl;
+        return false;
+    }
+    for(size_t e=1; e<imgin.size(); e++)
+    {
+        if(imgin[e].type() != imgin[0].type())
+        {
+            std::cerr << "ImageQuilting::synthesize() - exemplar " << e << " has another type than the first" << std::endl;
+            return false;
+        }
+    }
+    input_image = imgin[0];
+
+    // initialize the variables
+    tilesize = params.tilesize;
+    overlap = params.overlap;
+    num_tiles = params.num_tiles;
+    m_useconv = params.useconv;
+    m_complex = params.complex;
+    m_show_every_pic = params.show_every_pic;
+    m_kernels = params.kernels;
+    m_prune = params.prune;
+    m_transforms = params.transforms ? 8 : 1;
+    m_adaptive = params.adaptive;
+    m_split_threshold = params.split_threshold;
+    m_min_tilesize = params.min_tilesize;
+    err = params.err;
+    m_sequence_radius = params.sequence_radius;
+    m_temporal_weight = params.temporal_weight;
+    m_sequence_threshold = params.sequence_threshold;
+    m_coherence = params.coherence;
+    m_coherence_radius = params.coherence_radius;
+    m_coherence_random = params.coherence_random;
+    m_coherence_threshold = params.coherence_threshold;
+    m_checkpoint.clear();
+    m_first_row = 0;
+
+    input_height = input_image.rows;
+    input_width = input_image.cols;
+
+    for(size_t e=0; e<imgin.size(); e++)
+    {
+        if( (num_tiles < 1) || (overlap < 1) || (overlap >= tilesize) ||
+            (tilesize >= imgin[e].rows) || (tilesize >= imgin[e].cols) )
+        {
+            std::cerr << "ImageQuilting::synthesize() - invalid parameters for a "
+                      << imgin[e].rows << " X " << imgin[e].cols << " source" << std::endl;
+            return false;
+        }
+    }
+
+    // synthesize straight into the caller's image
+    int destsize = output_size(params);
+    if( (imgout.rows != destsize) || (imgout.cols != destsize) || (imgout.type() != CV_8UC(cn)) )
+    {
+        imgout.create(destsize, destsize, CV_8UC(cn));
+    }
+    imgout.setTo(cv::Scalar::all(0));
+    output_image = imgout;
+
+    placement.tilesize = tilesize;
+    placement.overlap = overlap;
+    placement.num_tiles = num_tiles;
+    placement.tiles.assign(num_tiles*num_tiles, TilePlacement());
+
+    // the sources do not change during the synthesis, prepare their planes once
+    // instead of splitting and converting them for every ssd
+    exemplars.assign(imgin.size(), QuiltExemplar());
+    for(size_t e=0; e<imgin.size(); e++)
+    {
+        QuiltExemplar &src = exemplars[e];
+        src.image = imgin[e];
+        if(m_kernels && m_useconv)
+        {
+            prepare_planes(src);
+        }
+
+        if(m_prune && !m_useconv)
+        {
+            cv::integral(src.image, src.window_sum, src.window_sqsum, CV_64F);
+        }
+    }
+    return true;
+}
+
+bool ImageQuilting::run(QuiltProgress &progress)
+{
+    if(m_adaptive)
+        return run_adaptive(progress);
+
+    //std::cout << "output size = [" << output_image.rows << "," << output_image.cols << "]" << std::endl;
+
+    int full_searches = 0;
+    for(int i=m_first_row; i<num_tiles; i++)
+    {
+        for(int j=0; j<num_tiles; j++)
+        {
+            std::cout << "[i,j] = [" << i << "," << j << "]" << std::endl;
+            TilePlacement &tile = placement.tiles[i*num_tiles+j];
+
+            set_tile(i, j);
+            if( !(m_coherence && coherent_tile(i, j, tile)) )
+            {
+                std::vector<cv::Mat> distances = tile_distances(i>0, j>0);
+                pick_tile(distances, tile, m_transforms);
+                full_searches++;
+            }
+            compute_seams(i>0, j>0, tile);
+            paste_tile(tile);
+
+            if(!finish_tile(i*num_tiles+j+1, num_tiles*num_tiles, progress))
+                return false;
+        }
+        checkpoint_row(i);
+    }
+    if(m_coherence)
+    {
+        std::cout << "DONE! " << full_searches << " of " << num_tiles*num_tiles << " tiles needed a full search" << std::endl;
+    }
+    else
+    {
+        std::cout << "DONE!" << std::endl;
+    }
+
+    return true;
+}
+
+bool ImageQuilting::run_frame(const QuiltSequence &sequence, QuiltProgress &progress)
+{
+    const std::vector<TilePlacement> &last = sequence.placement.tiles;
+    double n_tile = tilesize*tilesize*input_image.channels();
+    int full_searches = 0;
+
+    for(int i=0; i<num_tiles; i++)
+    {
+        for(int j=0; j<num_tiles; j++)
+        {
+            std::cout << "[i,j] = [" << i << "," << j << "]" << std::endl;
+            int k = i*num_tiles+j;
+            TilePlacement &tile = placement.tiles[k];
+            set_tile(i, j);
+
+            cv::Mat previous_tile = sequence.previous(Rect(startJ,startI,tilesize,tilesize));
+            double n_overlap = overlap_pixels(i>0, j>0)*input_image.channels();
+
+            // search a small neighbourhood around the offset this tile had in the previous frame,
+            // keeping its transform
+            int t = last[k].transform;
+            int cy = std::min(last[k].sub1, input_height-tilesize);
+            int cx = std::min(last[k].sub2, input_width-tilesize);
+            int y0 = std::max(0, cy - m_sequence_radius);
+            int y1 = std::min(input_height-tilesize, cy + m_sequence_radius);
+            int x0 = std::max(0, cx - m_sequence_radius);
+            int x1 = std::min(input_width-tilesize, cx + m_sequence_radius);
+
+            cv::Mat local(y1-y0+1, x1-x0+1, CV_64F);
+            for(int y=y0; y<=y1; y++)
+            {
+                for(int x=x0; x<=x1; x++)
+                {
+                    // mean squared errors, so the overlap and temporal terms are on the same scale
+                    double d = (n_overlap > 0) ? overlap_distance(0, y, x, t, i>0, j>0)/n_overlap : 0;
+                    d += m_temporal_weight*cv::norm(source_tile(0, y, x, t), previous_tile, NORM_L2SQR)/n_tile;
+                    local.at<double>(y-y0,x-x0) = d;
+                }
+            }
+
+            if(find_min(local) <= m_sequence_threshold)
+            {
+                std::vector<cv::Mat> maps(1, local);
+                pick_tile(maps, tile);
+                tile.sub1 += y0;
+                tile.sub2 += x0;
+                tile.transform = t;
+            }
+            else
+            {
+                // nothing close enough, fall back to a full search with the same distance
+                std::vector<cv::Mat> maps(1, frame_distances(previous_tile, i>0, j>0, n_overlap, n_tile));
+                pick_tile(maps, tile, m_transforms);
+                full_searches++;
+            }
+
+            // carry the previous seams forward while this tile and the ones it is cut against stay put
+            bool still = same_source(tile, last[k]) &&
+                         ((j==0) || same_source(placement.tiles[k-1], last[k-1])) &&
+                         ((i==0) || same_source(placement.tiles[k-num_tiles], last[k-num_tiles]));
+            if(still)
+            {
+                tile.vcut = last[k].vcut;
+                tile.hcut = last[k].hcut;
+            }
+            else
+            {
+                compute_seams(i>0, j>0, tile);
+            }
+            paste_tile(tile);
+
+            if(!finish_tile(i*num_tiles+j+1, num_tiles*num_tiles, progress))
+                return false;
+        }
+    }
+    std::cout << "DONE! " << full_searches << " of " << num_tiles*num_tiles << " tiles needed a full search" << std::endl;
+
+    return true;
+}
+
+// try the source regions that continue the left and top neighbours, around the offsets they
+// imply for this tile, and a few random ones; false when none of them is good enough and the
+// tile needs a full search
+bool ImageQuilting::coherent_tile(int _i, int _j, TilePlacement &_tile)
+{
+    bool top = _i > 0;
+    bool left = _j > 0;
+    double n_overlap = overlap_pixels(top, left)*input_image.channels();
+    if(n_overlap == 0)
+        return false;
+
+    std::vector<TilePlacement> candidates;
+    auto add = [&](int _e, int _sub1, int _sub2, int _t)
+    {
+        // the same positions as the distance maps of the full search
+        const cv::Mat &src = exemplars[_e].image;
+        if( (_sub1 < 0) || (_sub2 < 0) || (_sub1 >= src.rows-tilesize) || (_sub2 >= src.cols-tilesize) )
+            return;
+        TilePlacement c;
+        c.exemplar = _e;
+        c.sub1 = _sub1;
+        c.sub2 = _sub2;
+        c.transform = _t;
+        for(size_t k=0; k<candidates.size(); k++)
+        {
+            if(same_source(candidates[k], c))
+                return;
+        }
+        candidates.push_back(c);
+    };
+
+    // a neighbour one step away in the output continues one step away in its source,
+    // turned with the neighbour's transform
+    int step = tilesize - overlap;
+    const TilePlacement *neighbours[2] = { left ? &placement.tiles[_i*num_tiles+_j-1] : NULL,
+                                           top ? &placement.tiles[(_i-1)*num_tiles+_j] : NULL };
+    cv::Point shifts[2] = { cv::Point(step,0), cv::Point(0,step) };
+    for(int n=0; n<2; n++)
+    {
+        if(neighbours[n] == NULL)
+            continue;
+        const TilePlacement &nb = *neighbours[n];
+        int inv = dihedral_inverse(nb.transform);
+        cv::Point d = dihedral_point(shifts[n], tilesize, inv) - dihedral_point(cv::Point(0,0), tilesize, inv);
+        for(int dy=-m_coherence_radius; dy<=m_coherence_radius; dy++)
+        {
+            for(int dx=-m_coherence_radius; dx<=m_coherence_radius; dx++)
+            {
+                add(nb.exemplar, nb.sub1 + d.y + dy, nb.sub2 + d.x + dx, nb.transform);
+            }
+        }
+    }
+
+    std::uniform_int_distribution<int> pick_exemplar(0, exemplars.size()-1);
+    std::uniform_int_distribution<int> pick_transform(0, m_transforms-1);
+    for(int r=0; r<m_coherence_random; r++)
+    {
+        int e = pick_exemplar(rng);
+        std::uniform_int_distribution<int> pick_row(0, exemplars[e].image.rows-tilesize-1);
+        std::uniform_int_distribution<int> pick_col(0, exemplars[e].image.cols-tilesize-1);
+        int sub1 = pick_row(rng);
+        int sub2 = pick_col(rng);
+        add(e, sub1, sub2, pick_transform(rng));
+    }
+
+    // mean squared errors, so the threshold does not depend on the tile size
+    std::vector<double> distances(candidates.size());
+    double best = std::numeric_limits<double>::max();
+    for(size_t k=0; k<candidates.size(); k++)
+    {
+        const TilePlacement &c = candidates[k];
+        distances[k] = overlap_distance(c.exemplar, c.sub1, c.sub2, c.transform, top, left)/n_overlap;
+        best = std::min(best, distances[k]);
+    }
+    if( candidates.empty() || (best > m_coherence_threshold) )
+        return false;
+
+    // pick one of the candidates within the error of the best, as the full search does
+    std::vector<int> close;
+    for(size_t k=0; k<candidates.size(); k++)
+    {
+        if(distances[k] <= best*(err+1))
+        {
+            close.push_back(k);
+        }
+    }
+    std::uniform_int_distribution<int> pick(0, close.size()-1);
+    const TilePlacement &picked = candidates[close[pick(rng)]];
+    _tile.exemplar = picked.exemplar;
+    _tile.sub1 = picked.sub1;
+    _tile.sub2 = picked.sub2;
+    _tile.transform = picked.transform;
+    std::cout << "coherent tile [" << _tile.sub1 << "," << _tile.sub2 << "] of exemplar " << _tile.exemplar
+              << " out of " << candidates.size() << " candidates. best error = " << best << std::endl;
+    return true;
+}
+
+bool ImageQuilting::run_adaptive(QuiltProgress &progress)
+{
+    int searches = 0;
+    for(int i=m_first_row; i<num_tiles; i++)
+    {
+        for(int j=0; j<num_tiles; j++)
+        {
+            std::cout << "[i,j] = [" << i << "," << j << "]" << std::endl;
+            set_tile(i, j);
+            adaptive_tile(i>0, j>0, placement.tiles[i*num_tiles+j], searches);
+
+            if(!finish_tile(i*num_tiles+j+1, num_tiles*num_tiles, progress))
+                return false;
+        }
+        checkpoint_row(i);
+    }
+    std::cout << "DONE! " << searches << " searches for " << num_tiles*num_tiles << " tiles" << std::endl;
+
+    return true;
+}
+
+void ImageQuilting::adaptive_tile(bool _top, bool _left, TilePlacement &_tile, int &_searches)
+{
+    std::vector<cv::Mat> distances = tile_distances(_top, _left);
+    pick_tile(distances, _tile, m_transforms);
+    _searches++;
+
+    // the convolution distances are not exact, judge the pick by its real overlap error
+    int n = overlap_pixels(_top, _left)*input_image.channels();
+    double error = (n > 0) ? overlap_distance(_tile.exemplar, _tile.sub1, _tile.sub2, _tile.transform, _top, _left)/n : 0;
+    int sub = subtile_size(tilesize);
+
+    if( (error > m_split_threshold) && (sub >= m_min_tilesize) && (sub >= 2*overlap) )
+    {
+        // even the best candidate does not fit, search the quadrants one by one,
+        // each against what is written so far including the quadrants before it
+        std::cout << "split " << tilesize << " into " << sub << ", error = " << error << std::endl;
+        int y = startI, x = startJ, size = tilesize;
+        _tile.children.assign(4, TilePlacement());
+        for(int q=0; q<4; q++)
+        {
+            set_slot(y + (q/2)*(size-sub), x + (q%2)*(size-sub), sub);
+            adaptive_tile(_top || (q/2 > 0), _left || (q%2 > 0), _tile.children[q], _searches);
+        }
+        set_slot(y, x, size);
+        return;
+    }
+
+    compute_seams(_top, _left, _tile);
+    paste_tile(_tile);
+}
+
+bool ImageQuilting::run_fill(const cv::Mat &_mask, const cv::Rect &_region, QuiltProgress &progress)
+{
+    // source windows that cover a damaged pixel are never candidates
+    cv::Mat I;
+    cv::integral(_mask(_region) != 0, I, CV_32S);
+    int rows = _region.height-tilesize;
+    int cols = _region.width-tilesize;
+    cv::Mat damaged = I(Rect(tilesize,tilesize,cols,rows)) - I(Rect(0,tilesize,cols,rows))
+                    - I(Rect(tilesize,0,cols,rows)) + I(Rect(0,0,cols,rows));
+    cv::Mat blocked = (damaged > 0);
+    if(cv::countNonZero(blocked) == rows*cols)
+    {
+        std::cerr << "ImageQuilting::fill() - no undamaged source tile around the mask" << std::endl;
+        return false;
+    }
+
+    // a grid over the whole image, the last row and column are moved in to end at its border
+    int step = tilesize - overlap;
+    int rows_grid = (output_image.rows - tilesize + step - 1)/step + 1;
+    int cols_grid = (output_image.cols - tilesize + step - 1)/step + 1;
+    std::vector<cv::Point> slots;
+    for(int i=0; i<rows_grid; i++)
+    {
+        for(int j=0; j<cols_grid; j++)
+        {
+            int y = std::min(i*step, output_image.rows - tilesize);
+            int x = std::min(j*step, output_image.cols - tilesize);
+            if(cv::countNonZero(_mask(Rect(x,y,tilesize,tilesize))) > 0)
+            {
+                slots.push_back(cv::Point(x, y));
+            }
+        }
+    }
+
+    QuiltExemplar &src = exemplars[0];
+    prepare_planes(src);
+    cv::Mat squares;
+    select_square_sum(src.image.channels())(src.image, squares);
+
+    cv::Mat unknown = (_mask != 0);
+    for(size_t k=0; k<slots.size(); k++)
+    {
+        std::cout << "[y,x] = [" << slots[k].y << "," << slots[k].x << "]" << std::endl;
+        set_slot(slots[k].y, slots[k].x, tilesize);
+
+        // every known pixel of the tile constrains the match, whatever its value; the
+        // template and its mask are transformed instead of the source, as in the full search
+        cv::Rect R(startJ, startI, tilesize, tilesize);
+        cv::Mat known = (unknown(R) == 0);
+        std::vector<cv::Mat> distances(1, cv::Mat(rows*m_transforms, cols, CV_64F));
+        for(int t=0; t<m_transforms; t++)
+        {
+            int inv = dihedral_inverse(t);
+            cv::Mat tmpl, weights;
+            dihedral(output_image(R), tmpl, inv);
+            dihedral(known, weights, inv);
+
+            cv::Mat d = distances[0].rowRange(t*rows, (t+1)*rows);
+            masked_ssd(src, squares, tmpl, weights)(Rect(0,0,cols,rows)).copyTo(d);
+            d.setTo(std::numeric_limits<double>::max(), blocked);
+        }
+        TilePlacement tile;
+        pick_tile(distances, tile, m_transforms);
+        fill_tile(tile, unknown);
+
+        if(!finish_tile(k+1, slots.size(), progress))
+            return false;
+    }
+    std::cout << "DONE! " << slots.size() << " tiles filled" << std::endl;
+
+    return true;
+}
+
+// write a tile over the unknown pixels, cut into the known ones around it on every side that
+// is not the image border; the bands are flipped so each is cut like the left or the top overlap
+void ImageQuilting::fill_tile(const TilePlacement &_tile, cv::Mat &_unknown)
+{
+    cv::Mat B = source_tile(_tile.exemplar, _tile.sub1, _tile.sub2, _tile.transform);
+    cv::Rect R(startJ, startI, tilesize, tilesize);
+    cv::Mat A = output_image(R);
+    cv::Mat U = _unknown(R);
+
+    // left, top, right, bottom
+    bool sides[4] = { startJ > 0, startI > 0, startJ+tilesize < output_image.cols, startI+tilesize < output_image.rows };
+    std::vector<int> cuts[4];
+    if(m_complex)
+    {
+        // the unknown pixels take the new tile anyway, they cost nothing to cut through
+        cv::Mat E = overlap_energy(B, A);
+        E.setTo(0, U);
+        cv::Rect bands[4] = { Rect(0,0,overlap,tilesize), Rect(0,0,tilesize,overlap),
+                              Rect(tilesize-overlap,0,overlap,tilesize), Rect(0,tilesize-overlap,tilesize,overlap) };
+        for(int s=0; s<4; s++)
+        {
+            if(!sides[s])
+                continue;
+            int direction = s % 2;
+            cv::Mat band;
+            if(s < 2)
+            {
+                E(bands[s]).copyTo(band);
+            }
+            else
+            {
+                cv::flip(E(bands[s]), band, (direction == 0) ? 1 : 0);
+            }
+            cv::Mat C = mincut(band, direction);
+            cuts[s] = cut_positions(C, direction);
+        }
+    }
+
+    cv::Mat M = U.clone();
+    int last = tilesize-1;
+    for(int r=0; r<tilesize; r++)
+    {
+        for(int c=0; c<tilesize; c++)
+        {
+            bool band = (sides[0] && (c < overlap)) || (sides[1] && (r < overlap)) ||
+                        (sides[2] && (c > last-overlap)) || (sides[3] && (r > last-overlap));
+            bool past = (cuts[0].empty() || (c >= cuts[0][r])) && (cuts[1].empty() || (r >= cuts[1][c])) &&
+                        (cuts[2].empty() || (last-c >= cuts[2][r])) && (cuts[3].empty() || (last-r >= cuts[3][c]));
+            if(band && past)
+            {
+                M.at<uchar>(r,c) = 255;
+            }
+        }
+    }
+
+    B.copyTo(A, M);
+    U.setTo(cv::Scalar::all(0));
+}
+
+int ImageQuilting::subtile_size(int _size)
+{
+    // two quadrants overlapping by at least the overlap width cover the tile
+    return (_size + overlap + 1)/2;
+}
+
+bool ImageQuilting::has_splits(const QuiltPlacement &_placement)
 {
+    for(size_t k=0; k<_placement.tiles.size(); k++)
+    {
+        if(!_placement.tiles[k].children.empty())
+            return true;
+    }
+    return false;
 }
 
-cv::Mat ImageQuilting::qimage_to_mat(QImage &imgin, bool inCloneImageData = true)
+// a tile of _size pixels from one of the sources: inside the source, cuts within the
+// tile, and quadrants only where the adaptive mode could have split it
+bool ImageQuilting::valid_tile(const TilePlacement &_tile, int _size)
 {
-    switch ( imgin.format() )
-     {
-        // 8-bit, 4 channel
-        case QImage::Format_ARGB32:
-        case QImage::Format_ARGB32_Premultiplied:
+    if( (_tile.exemplar < 0) || (_tile.exemplar >= (int)exemplars.size()) )
+        return false;
+    const cv::Mat &src = exemplars[_tile.exemplar].image;
+    if( (_tile.sub1 < 0) || (_tile.sub2 < 0) || (_tile.transform < 0) || (_tile.transform > 7) ||
+        (_tile.sub1 + _size > src.rows) || (_tile.sub2 + _size > src.cols) )
+        return false;
+
+    const std::vector<int> *cuts[2] = { &_tile.vcut, &_tile.hcut };
+    for(int c=0; c<2; c++)
+    {
+        if( !cuts[c]->empty() && ((int)cuts[c]->size() != _size) )
+            return false;
+        for(size_t k=0; k<cuts[c]->size(); k++)
         {
-           cv::Mat  mat( imgin.height(), imgin.width(),
-                         CV_8UC4,
-                         const_cast<uchar*>(imgin.bits()),
-                         static_cast<size_t>(imgin.bytesPerLine())
-                         );
-
-           return (inCloneImageData ? mat.clone() : mat);
+            if( ((*cuts[c])[k] < 0) || ((*cuts[c])[k] > _size) )
+                return false;
         }
+    }
 
-        // 8-bit, 3 channel
-        case QImage::Format_RGB32:
-        case QImage::Format_RGB888:
-        {
-           if ( !inCloneImageData )
-           {
-              qWarning() << "ImageQuilting::qimage_to_mat() - Conversion requires cloning because we use a temporary QImage";
-           }
+    if(_tile.children.empty())
+        return true;
+
+    int sub = subtile_size(_size);
+    if( (_tile.children.size() != 4) || (sub < 2*overlap) )
+        return false;
+    for(int q=0; q<4; q++)
+    {
+        if(!valid_tile(_tile.children[q], sub))
+            return false;
+    }
+    return true;
+}
 
-           QImage   swapped = imgin;
+bool ImageQuilting::single_exemplar(const QuiltPlacement &_placement)
+{
+    for(size_t k=0; k<_placement.tiles.size(); k++)
+    {
+        if(_placement.tiles[k].exemplar != 0)
+            return false;
+    }
+    return true;
+}
 
-           if ( imgin.format() == QImage::Format_RGB32 )
-           {
-              swapped = swapped.convertToFormat( QImage::Format_RGB888 );
-           }
+void ImageQuilting::set_tile(int _i, int _j)
+{
+    // the grid uses the tile size of the run, quadrants are placed with set_slot
+    int step = placement.tilesize - overlap;
+    set_slot(_i*step, _j*step, placement.tilesize);
+}
 
-           swapped = swapped.rgbSwapped();
+void ImageQuilting::set_slot(int _y, int _x, int _size)
+{
+    tilesize = _size;
+    startI = _y;
+    startJ = _x;
+    endI = startI + tilesize - 1;
+    endJ = startJ + tilesize - 1;
+}
 
-           return cv::Mat( swapped.height(), swapped.width(),
-                           CV_8UC3,
-                           const_cast<uchar*>(swapped.bits()),
-                           static_cast<size_t>(swapped.bytesPerLine())
-                           ).clone();
-        }
+bool ImageQuilting::finish_tile(int _done, int _total, QuiltProgress &progress)
+{
+    if(m_show_every_pic)
+    {
+        cv::imshow("output_image", output_image);
+        cv::waitKey();
+        cv::destroyAllWindows();
+    }
 
-        // 8-bit, 1 channel
-        case QImage::Format_Indexed8:
-        {
-           cv::Mat  mat( imgin.height(), imgin.width(),
-                         CV_8UC1,
-                         const_cast<uchar*>(imgin.bits()),
-                         static_cast<size_t>(imgin.bytesPerLine())
-                         );
+    if( progress && !progress(_done, _total) )
+    {
+        std::cout << "CANCELLED" << std::endl;
+        return false;
+    }
+    return true;
+}
 
-           return (inCloneImageData ? mat.clone() : mat);
-        }
+std::vector<cv::Mat> ImageQuilting::tile_distances(bool _top, bool _left, bool _prune)
+{
+    // the searches of every exemplar and transform only read the output, run them in parallel
+    int n = exemplars.size()*m_transforms;
+    std::vector<cv::Mat> maps(n);
+    std::vector<int> evaluated(n, 0), candidates(n, 0);
+    cv::parallel_for_(cv::Range(0, n), ParallelIndex([&](int k)
+    {
+        maps[k] = transform_distances(k/m_transforms, _top, _left, k%m_transforms, _prune, evaluated[k], candidates[k]);
+    }));
 
-        default:
-           qWarning() << "ImageQuilting::qimage_to_mat() - QImage format not handled in switch:" << imgin.format();
-           break;
-     }
+    // the pruned searches report once here, not from the workers
+    int total_evaluated = 0, total_candidates = 0;
+    for(int k=0; k<n; k++)
+    {
+        total_evaluated += evaluated[k];
+        total_candidates += candidates[k];
+    }
+    if(total_candidates > 0)
+    {
+        std::cout << "evaluated " << total_evaluated << " of " << total_candidates << " candidates" << std::endl;
+    }
 
-     return cv::Mat();
+    // one map per exemplar, with the maps of every transform stacked; pick_tile
+    // takes the transform from the row
+    std::vector<cv::Mat> distances(exemplars.size());
+    for(int k=0; k<n; k++)
+    {
+        distances[k/m_transforms].push_back(maps[k]);
+    }
+    return distances;
 }
 
-QImage ImageQuilting::mat_to_qimage(cv::Mat &mat)
+cv::Mat ImageQuilting::transform_distances(int _e, bool _top, bool _left, int _t, bool _prune, int &_evaluated, int &_candidates)
 {
-    // NOTE: This does not cover all cases - it should be easy to add new ones as required.
-    switch ( mat.type() )
+    const QuiltExemplar &src = exemplars[_e];
+
+    // every position is a candidate for the first tile
+    cv::Mat distances = cv::Mat::zeros(src.image.rows-tilesize, src.image.cols-tilesize, CV_64F);
+    cv::Mat distances_tmp;
+    cv::Mat Z;
+
+    // a source tile under transform t is compared with the template under the inverse
+    // transform, so only the template is transformed and never the source
+    int inv = dihedral_inverse(_t);
+    cv::Mat tmpl;
+    dihedral(output_image(Rect(startJ,startI,tilesize,tilesize)), tmpl, inv);
+
+    std::vector<cv::Rect> regions = overlap_regions(_top, _left);
+    for(size_t r=0; r<regions.size(); r++)
     {
-        // 8-bit, 4 channel
-        case CV_8UC4:
-        {
-            QImage image( mat.data,
-                       mat.cols, mat.rows,
-                       static_cast<int>(mat.step),
-                       QImage::Format_ARGB32 );
+        regions[r] = dihedral_rect(regions[r], tilesize, inv);
+    }
 
-            return image;
+    if( (m_useconv==0) && _prune && pruned_distances(src, tmpl, regions, distances, _evaluated, _candidates) )
+    {
+        // only the candidates that can be within the error were evaluated
+    }
+    else if( (m_useconv==0) && m_kernels )
+    {
+        // the written pixels are in the overlap, unless something was pasted elsewhere in the tile
+        int ov = overlap;
+        if(cv::countNonZero(tmpl(Rect(overlap,overlap,tilesize-overlap,tilesize-overlap)).reshape(1)) > 0)
+        {
+            ov = tilesize;
         }
-
-        // 8-bit, 3 channel
-        case CV_8UC3:
+        select_brute_kernel(src.image.channels(), ov)(src.image, tmpl, ov, distances);
+    }
+    else if( m_useconv==0 )
+    {
+        // compute the distances from the template to target for all i and j
+        for(int a=0; a<distances.rows; a++)
         {
-            QImage image( mat.data,
-                       mat.cols, mat.rows,
-                       static_cast<int>(mat.step),
-                       QImage::Format_RGB888 );
+            cv::Mat v1;
+            tmpl.copyTo(v1);
+            cv::Mat v1_flatten = v1.reshape(1,v1.rows*v1.cols*v1.channels());
+            for(int b=0; b<distances.cols; b++)
+            {
+                cv::Mat v2;
+                src.image(Rect(b,a,tilesize,tilesize)).copyTo(v2);
+                cv::Mat v2_flatten = v2.reshape(1,v2.rows*v2.cols*v2.channels());
 
-            return image.rgbSwapped();
-        }
+                v1_flatten.convertTo(v1_flatten, CV_64F, 1, 0);
+                v2_flatten.convertTo(v2_flatten, CV_64F, 1, 0);
+                cv::Mat v1_flatten_thresh = ((v1_flatten>0)/255);
+                v1_flatten_thresh.convertTo(v1_flatten_thresh, CV_64F, 1, 0);
+                cv::Mat myssd_input = v1_flatten_thresh.mul((v1_flatten - v2_flatten));
 
-        // 8-bit, 1 channel
-        case CV_8UC1:
+                distances.at<double>(a,b) = myssd( myssd_input );
+            }
+        }
+    }
+    else
+    {
+        // the left overlap, plus the top overlap, minus the corner they share
+        std::vector<cv::Rect> parts;
+        if(_left)
         {
-#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
-            QImage image( mat.data,
-                       mat.cols, mat.rows,
-                       static_cast<int>(mat.step),
-                       QImage::Format_Grayscale8 );
-#else
-            static QVector<QRgb>  sColorTable;
+            parts.push_back(Rect(0,0,overlap,tilesize));
+        }
+        if(_top)
+        {
+            parts.push_back(Rect(0,0,tilesize,overlap));
+        }
+        if(_top && _left)
+        {
+            parts.push_back(Rect(0,0,overlap,overlap));
+        }
 
-            // only create our color table the first time
-            if ( sColorTable.isEmpty() )
+        int rows = src.image.rows-tilesize+1;
+        int cols = src.image.cols-tilesize+1;
+        for(size_t p=0; p<parts.size(); p++)
+        {
+            // compute the distances from the source to the region, and crop them
+            // at the offset of the region in the transformed template
+            cv::Rect R = dihedral_rect(parts[p], tilesize, inv);
+            cv::Mat region;
+            tmpl(R).copyTo(region);
+            distances_tmp = source_ssd(src, region);
+            distances_tmp(Rect(R.x,R.y,cols,rows)).copyTo(Z);
+
+            if(p == 0)
             {
-                sColorTable.resize( 256 );
-
-                for ( int i = 0; i < 256; ++i )
-                {
-                    sColorTable[i] = qRgb( i, i, i );
-                }
+                distances = Z;
+            }
+            else if(p == 1)
+            {
+                distances = distances + Z;
+            }
+            else
+            {
+                distances = distances - Z;
             }
+        }
+    }
+    //std::cout << "distances = [" << distances.rows << ", " << distances.cols << "]" << std::endl;
+    return distances;
+}
 
-            QImage image( mat.data,
-                       mat.cols, mat.rows,
-                       static_cast<int>(mat.step),
-                       QImage::Format_Indexed8 );
+// sums of every tilesize X tilesize window over the sub rectangle R of the window,
+// from an integral image
+static cv::Mat window_sums(const cv::Mat &I, const cv::Rect &R, int _rows, int _cols)
+{
+    return I(Rect(R.x+R.width,R.y+R.height,_cols,_rows)) - I(Rect(R.x,R.y+R.height,_cols,_rows))
+         - I(Rect(R.x+R.width,R.y,_cols,_rows)) + I(Rect(R.x,R.y,_cols,_rows));
+}
 
-            image.setColorTable( sColorTable );
-#endif
+// _evaluated gets the number of candidates whose distance was computed, _candidates the number of all of them
+bool ImageQuilting::pruned_distances(const QuiltExemplar &_src, const cv::Mat &tmpl, const std::vector<cv::Rect> &regions, cv::Mat &distances,
+                                     int &_evaluated, int &_candidates)
+{
+    if( _src.window_sum.empty() || regions.empty() )
+        return false;
+
+    // the bounds are on the plain ssd over the overlap, which is the masked ssd of the
+    // search only when every overlap value is written and nothing else is
+    int cn = _src.image.channels();
+    int written = 0, area = 0;
+    for(size_t r=0; r<regions.size(); r++)
+    {
+        written += cv::countNonZero(tmpl(regions[r]).reshape(1));
+        area += regions[r].area()*cn;
+    }
+    if( (written != area) || (cv::countNonZero(tmpl.reshape(1)) != written) )
+        return false;
+
+    // per region and channel, with a the template and b the window,
+    //   ssd >= (sum(a) - sum(b))^2 / n                  (mean difference)
+    //   ssd >= (sqrt(sum(a^2)) - sqrt(sum(b^2)))^2      (triangle inequality)
+    int rows = distances.rows;
+    int cols = distances.cols;
+    cv::Mat bound = cv::Mat::zeros(rows, cols, CV_64F);
+    for(size_t r=0; r<regions.size(); r++)
+    {
+        cv::Mat a;
+        tmpl(regions[r]).convertTo(a, CV_64F, 1, 0);
+        cv::Scalar a_sum = cv::sum(a);
+        cv::Scalar a_sqsum = cv::sum(a.mul(a));
+        double n = regions[r].area();
+
+        std::vector<cv::Mat> b_sum, b_sqsum;
+        cv::split(window_sums(_src.window_sum, regions[r], rows, cols), b_sum);
+        cv::split(window_sums(_src.window_sqsum, regions[r], rows, cols), b_sqsum);
+        for(int k=0; k<cn; k++)
+        {
+            cv::Mat mean_bound = b_sum[k] - a_sum[k];
+            mean_bound = mean_bound.mul(mean_bound)/n;
+            cv::Mat norm_bound;
+            cv::sqrt(b_sqsum[k], norm_bound);
+            norm_bound = norm_bound - std::sqrt(a_sqsum[k]);
+            norm_bound = norm_bound.mul(norm_bound);
+            bound = bound + cv::max(mean_bound, norm_bound);
+        }
+    }
 
-            return image;
+    // evaluate the candidates from the smallest bound up, once a bound is over the
+    // threshold of the best exact distance so far no later candidate can be selected
+    std::vector< std::pair<double,int> > order(rows*cols);
+    for(int a=0; a<rows; a++)
+    {
+        const double *p = bound.ptr<double>(a);
+        for(int b=0; b<cols; b++)
+        {
+            // the exact distances are integers, keep the bound safely below them
+            order[a*cols+b] = std::make_pair(std::max(0.0, p[b]*(1-1e-9) - 1e-6), a*cols+b);
         }
+    }
+    std::sort(order.begin(), order.end());
 
-        default:
-            qWarning() << "ImageQuilting::mat_to_qimage() - cv::Mat image type not handled in switch:" << mat.type();
+    double best = std::numeric_limits<double>::max();
+    size_t k = 0;
+    for(; k<order.size(); k++)
+    {
+        if(order[k].first > best*(err+1))
             break;
+        int a = order[k].second/cols;
+        int b = order[k].second%cols;
+        double d = 0;
+        for(size_t r=0; r<regions.size(); r++)
+        {
+            const cv::Rect &R = regions[r];
+            d += cv::norm(_src.image(Rect(b+R.x,a+R.y,R.width,R.height)), tmpl(R), NORM_L2SQR);
+        }
+        distances.at<double>(a,b) = d;
+        best = std::min(best, d);
     }
-    return QImage();
+    _evaluated = k;
+    _candidates = order.size();
+
+    // the rest keep their bound, which is over the threshold
+    for(; k<order.size(); k++)
+    {
+        distances.at<double>(order[k].second/cols, order[k].second%cols) = order[k].first;
+    }
+    return true;
 }
 
-void ImageQuilting::synthesize(QImage &imgin, QImage &imgout, int _tilesize, int _num_tiles, int _overlap, bool _useconv)
+double ImageQuilting::pick_tile(std::vector<cv::Mat> &distances, TilePlacement &_tile, int _transforms)
 {
-    // initialize the variables
-    input_image = qimage_to_mat(imgin);
-    tilesize = _tilesize;
-    overlap = _overlap;
-    num_tiles = _num_tiles;
-    m_useconv = _useconv;
-    err = 0.002;
+    // find the best match over all exemplars
+    double best = std::numeric_limits<double>::max();
+    for(size_t e=0; e<distances.size(); e++)
+    {
+        best = std::min(best, find_min(distances[e]));
+    }
 
-    input_height = input_image.rows;
-    input_width = input_image.cols;
-    cv::Mat distances = cv::Mat::zeros(input_height-tilesize, input_width-tilesize, CV_64F);
-    cv::Mat distances_tmp = distances.clone();
-    cv::Mat Z, Z_tmp;
-    cv::Mat candidates;
-    cv::Mat M;
+    // the candidates of every exemplar in one pool, as (exemplar, index into its map)
+    std::vector< std::pair<int,int> > candidates;
+    for(size_t e=0; e<distances.size(); e++)
+    {
+        cv::Mat found = find_candidates(distances[e], best);
+        for(int k=0; k<found.cols; k++)
+        {
+            candidates.push_back(std::make_pair((int)e, (int)found.at<double>(0,k)));
+        }
+    }
+
+    //std::cout << "candidates = " << candidates.size() << std::endl;
+
+    // pick one of the candidates uniformly at random
+    std::uniform_int_distribution<int> pick(0, candidates.size()-1);
+    std::pair<int,int> picked = candidates[pick(rng)];
+    int idx = picked.second;
+    std::cout << "idx = " << idx << std::endl;
+
+    _tile.exemplar = picked.first;
+    ind2sub(distances[picked.first], idx, _tile.sub1, _tile.sub2);
+
+    // with transforms the maps are stacked, one block of rows per transform
+    int block = distances[picked.first].rows/_transforms;
+    _tile.transform = _tile.sub1/block;
+    _tile.sub1 = _tile.sub1%block;
+    std::cout << "pick tile [" << _tile.sub1 << "," << _tile.sub2 << "] of exemplar " << _tile.exemplar
+              << " out of " << candidates.size() << " candidates.";
+    std::cout << " best error = " << best << std::endl;
+    return best;
+}
+
+void ImageQuilting::compute_seams(bool _top, bool _left, TilePlacement &_tile)
+{
     cv::Mat E, C;
 
-    int destsize = num_tiles*tilesize - (num_tiles-1)*overlap;
-    output_image = cv::Mat::zeros(destsize, destsize, CV_8UC3);
-    //std::cout << "output size = [" << output_image.rows << "," << output_image.cols << "]" << std::endl;
+    _tile.vcut.clear();
+    _tile.hcut.clear();
 
-    double best;
+    // simple synthesize and the first tile are plain copies without seams
+    if( !m_complex || (!_top && !_left) )
+        return;
 
-    for(int i=0; i<num_tiles; i++)
+    cv::Mat B = source_tile(_tile.exemplar, _tile.sub1, _tile.sub2, _tile.transform);
+
+    // if we have a left overlap
+    if(_left)
     {
-        for(int j=0; j<num_tiles; j++)
-        {
-            std::cout << "[i,j] = [" << i << "," << j << "]" << std::endl;
-            startI = (i)*tilesize - (i)*overlap;
-            startJ = (j)*tilesize - (j)*overlap;
-            endI = startI + tilesize - 1;
-            endJ = startJ + tilesize - 1;
+        // compute the ssd in the border region
+        E = overlap_energy(B(Rect(0,0,overlap,tilesize)), output_image(Rect(startJ,startI,overlap,endI-startI+1)));
+
+        // compute the mincut array
+        C = mincut(E, 0);
+        _tile.vcut = cut_positions(C, 0);
+    }
 
-            if( m_useconv==0 )
+    if(_top)
+    {
+        // compute the ssd in the border region
+        E = overlap_energy(B(Rect(0,0,tilesize,overlap)), output_image(Rect(startJ,startI,endJ-startJ+1,overlap)));
+
+        // compute the mincut array
+        C = mincut(E,1);
+        _tile.hcut = cut_positions(C, 1);
+    }
+}
+
+cv::Mat ImageQuilting::overlap_energy(const cv::Mat &_a, const cv::Mat &_b)
+{
+    // squared difference per pixel, summed over all channels
+    std::vector<cv::Mat> a_split, b_split;
+    cv::split(_a, a_split);
+    cv::split(_b, b_split);
+
+    cv::Mat E = cv::Mat::zeros(_a.rows, _a.cols, CV_64F);
+    cv::Mat a, b;
+    for(size_t k=0; k<a_split.size(); k++)
+    {
+        // need to convert to double, so that we can calculate
+        a_split[k].convertTo(a, CV_64F, 1, 0);
+        b_split[k].convertTo(b, CV_64F, 1, 0);
+        cv::Mat D = a - b;
+        E = E + D.mul(D);
+    }
+    return E;
+}
+
+std::vector<int> ImageQuilting::cut_positions(cv::Mat &C, int _direction)
+{
+    // the cut array is -1 before the cut, 0 on it and +1 after it
+    int n = (_direction == 0) ? C.rows : C.cols;
+    int len = (_direction == 0) ? C.cols : C.rows;
+    std::vector<int> cut(n, 0);
+
+    for(int k=0; k<n; k++)
+    {
+        for(int l=0; l<len; l++)
+        {
+            double c = (_direction == 0) ? C.at<double>(k,l) : C.at<double>(l,k);
+            if(c == 0)
             {
-                // compute the distances from the template to target for all i and j
-                for(int a=0; a<distances.rows; a++)
-                {
-                    cv::Mat v1;
-                    output_image(Rect(startJ,startI,endJ-startJ+1,endI-startI+1)).copyTo(v1);
-                    cv::Mat v1_flatten = v1.reshape(1,v1.rows*v1.cols*v1.channels());
-                    for(int b=0; b<distances.cols; b++)
-                    {
-                        cv::Mat v2;
-                        input_image(Rect(b,a,tilesize,tilesize)).copyTo(v2);
-                        cv::Mat v2_flatten = v2.reshape(1,v2.rows*v2.cols*v2.channels());
-
-                        v1_flatten.convertTo(v1_flatten, CV_64F, 1, 0);
-                        v2_flatten.convertTo(v2_flatten, CV_64F, 1, 0);
-                        cv::Mat v1_flatten_thresh = ((v1_flatten>0)/255);
-                        v1_flatten_thresh.convertTo(v1_flatten_thresh, CV_64F, 1, 0);
-                        cv::Mat myssd_input = v1_flatten_thresh.mul((v1_flatten - v2_flatten));
-
-                        distances.at<double>(a,b) = myssd( myssd_input );
-                    }
-                }
+                cut[k] = l;
+                break;
             }
-            else
-            {
-                // compute the distances from the source to the left overlap region
-                if(j>0)
-                {
-                    output_image(Rect(startJ,startI,overlap,endI-startI+1)).copyTo(output_image_roi);
-                    distances_tmp = ssd(input_image,output_image_roi);
+        }
+    }
+    return cut;
+}
 
-                    // crop distances
-                    distances_tmp(cv::Rect(0,0,distances_tmp.cols-tilesize+overlap,distances_tmp.rows)).copyTo(distances);
-                }
+void ImageQuilting::paste_tile(const TilePlacement &_tile)
+{
+    if(!_tile.children.empty())
+    {
+        // a split tile is its four quadrants, in the order they were synthesized
+        int y = startI, x = startJ, size = tilesize;
+        int sub = subtile_size(size);
+        for(int q=0; q<4; q++)
+        {
+            set_slot(y + (q/2)*(size-sub), x + (q%2)*(size-sub), sub);
+            paste_tile(_tile.children[q]);
+        }
+        set_slot(y, x, size);
+        return;
+    }
 
-                // compute the distances from the source to the top overlap region
-                if(i>0)
-                {
-                    output_image(Rect(startJ,startI,endJ-startJ+1,overlap)).copyTo(output_image_roi);
-                    Z_tmp = ssd(input_image,output_image_roi);
-
-                    // crop Z
-                    Z_tmp(cv::Rect(0,0,Z_tmp.cols,Z_tmp.rows-tilesize+overlap)).copyTo(Z);
-
-                    if(j>0)
-                    {
-                        distances = distances + Z;
-                    }
-                    else
-                    {
-                        distances = Z;
-                    }
-                }
+    cv::Mat B = source_tile(_tile.exemplar, _tile.sub1, _tile.sub2, _tile.transform);
 
-                // if both are greater, compute the distance of the overlap
-                if((i>0) && (j>0))
-                {
-                    output_image(Rect(startJ,startI,overlap,overlap)).copyTo(output_image_roi);
-                    Z_tmp = ssd(input_image,output_image_roi);
+    if( _tile.vcut.empty() && _tile.hcut.empty() )
+    {
+        // random copy paste from the sample texture
+        B.copyTo(output_image(Rect(startJ,startI,tilesize,tilesize)));
+        return;
+    }
 
-                    // crop Z
-                    Z_tmp(cv::Rect(0,0,Z_tmp.cols-tilesize+overlap,Z_tmp.rows-tilesize+overlap)).copyTo(Z);
-                    distances = distances - Z;
-                }
+    if(m_kernels)
+    {
+        cv::Mat A = output_image(Rect(startJ,startI,tilesize,tilesize));
+        select_paste(input_image.channels())(B, _tile.vcut, _tile.hcut, A);
+        return;
+    }
 
-                output_image_roi.release();
-                Z_tmp.release();
+    // rebuild the mask from the cuts, the new tile is taken from the cut on
+    cv::Mat M = Mat::ones(tilesize, tilesize, CV_64F);
+    for(size_t r=0; r<_tile.vcut.size(); r++)
+    {
+        for(int c=0; c<_tile.vcut[r]; c++)
+        {
+            M.at<double>(r,c) = 0;
+        }
+    }
+    for(size_t c=0; c<_tile.hcut.size(); c++)
+    {
+        for(int r=0; r<_tile.hcut[c]; r++)
+        {
+            M.at<double>(r,c) = 0;
+        }
+    }
 
-            }
-            //std::cout << "distances = [" << distances.rows << ", " << distances.cols << "]" << std::endl;
-            //std::cout << "distances = "<< std::endl << " "  << distances << std::endl << std::endl;
-            // find the best candidates for the match
-            best = find_min(distances);
-            //std::cout << "best = " << best << std::endl;
-            candidates = find_candidates(distances, best);
-
-            //std::cout << "candidates = "<< std::endl << " "  << candidates << std::endl << std::endl;
-            //std::cout << "candidates = [" << candidates.rows << ", " << candidates.cols << "]" << std::endl;
-
-            // generate uniformly random number
-            double random_number = ((double) rand() / (RAND_MAX));
-            //std::cout << "random_number = " << random_number << std::endl;
-
-            //std::cout << std::floor(random_number*candidates.cols) << std::endl;
-            //std::cout << candidates.at<double>(0,0) << std::endl;
-            int idx = candidates.at<double>(0,(std::floor(random_number*candidates.cols)));
-            std::cout << "idx = " << idx << std::endl;
-
-            int sub1, sub2;
-            ind2sub(distances, idx, sub1, sub2);
-            //std::cout << "sub = [" << sub1 << "," << sub2 << "]" << std::endl;
-            std::cout << "pick tile [" << sub1 << "," << sub2 << "] out of " << candidates.cols << " candidates.";
-            std::cout << " best error = " << best << std::endl;
-
-            if(!m_complex)
-            {
-                // simple synthesize, random copy paste from the sample texture
-                input_image(Rect(sub2,sub1,tilesize,tilesize)).copyTo(output_image(Rect(startJ,startI,tilesize,tilesize)));
-            }
-            else
-            {
-                // initialize the mask to all ones
-                M = Mat::ones(tilesize, tilesize, CV_64F);
+    // write to the destination using the mask
+    cv::Mat A = output_image(Rect(startJ,startI,endJ-startJ+1,endI-startI+1));
+    output_image(Rect(startJ,startI,endJ-startJ+1,endI-startI+1)) = filtered_write(A, B, M);
+}
 
-                // if we have a left overlap
-                if(j>0)
-                {
-                    // compute the ssd in the border region
-                    // extract the first channel of the input and output, and convert them to CV_64F
-                    cv::Mat input_split[3], output_split[3];
-                    cv::split(input_image(Rect(sub2,sub1,overlap,tilesize)), input_split);
-                    cv::split(output_image(Rect(startJ,startI,overlap,endI-startI+1)), output_split);
-                    // need to convert to double, so that we can calculate
-                    input_split[0].convertTo(input_split[0], CV_64F, 1, 0);
-                    output_split[0].convertTo(output_split[0], CV_64F, 1, 0);
-                    E =  input_split[0] - output_split[0];
-                    cv::Mat E_2 = E;
-                    cv::pow(E, 2, E_2);
-
-                    // compute the mincut array
-                    C = mincut(E_2, 0);
-                    //std::cout << "C = [" << C.rows << ", " << C.cols << "]" << std::endl;
-                    //std::cout << "C = "<< std::endl << " "  << C << std::endl << std::endl;
-
-                    // compute the mask and write to the destination
-                    cv::Mat C_thresh_vertical = ((C>=0)/255);
-                    C_thresh_vertical.convertTo(C_thresh_vertical, CV_64F, 1, 0);
-                    //std::cout << "C_thresh_vertical = "<< std::endl << " "  << C_thresh_vertical << std::endl << std::endl;
-                    C_thresh_vertical.copyTo(M(Rect(0,0,overlap,M.cols)));
-                    //std::cout << "M = "<< std::endl << " "  << M << std::endl << std::endl;
-                }
+// the ssd of Y against every position of the source, exactly: the sum of squares from the
+// integral image and an unnormalized cross correlation per channel
+cv::Mat ImageQuilting::exact_ssd(const QuiltExemplar &_src, const cv::Mat &Y)
+{
+    int rows = _src.image.rows - Y.rows + 1;
+    int cols = _src.image.cols - Y.cols + 1;
+    const cv::Mat &I = _src.sqsum;
+    cv::Mat Z = I(Rect(Y.cols,Y.rows,cols,rows)) - I(Rect(0,Y.rows,cols,rows))
+              - I(Rect(Y.cols,0,cols,rows)) + I(Rect(0,0,cols,rows));
+
+    std::vector<cv::Mat> Y_split;
+    cv::split(Y, Y_split);
+    cv::Mat B, ab_tmp;
+    for(size_t k=0; k<Y_split.size(); k++)
+    {
+        Y_split[k].convertTo(B, CV_64F, 1, 0);
+        cv::filter2D(_src.planes[k], ab_tmp, -1, B, Point(0,0), 0, cv::BORDER_CONSTANT);
+        Z = Z - ab_tmp(Rect(0, 0, cols, rows))*2 + B.dot(B);
+    }
+    return Z;
+}
 
-                if(i>0)
-                {
-                    // compute the ssd in the border region
-                    cv::Mat input_split[3], output_split[3];
-                    cv::split(input_image(Rect(sub2,sub1,tilesize,overlap)), input_split);
-                    cv::split(output_image(Rect(startJ,startI,endJ-startJ+1,overlap)), output_split);
-                    input_split[0].convertTo(input_split[0], CV_64F, 1, 0);
-                    output_split[0].convertTo(output_split[0], CV_64F, 1, 0);
-                    E =  input_split[0] - output_split[0];
-                    cv::Mat E_2 = E;
-                    cv::pow(E, 2, E_2);
-
-                    // compute the mincut array
-                    C = mincut(E_2,1);
-                    //std::cout << "C = "<< std::endl << " "  << C << std::endl << std::endl;
-
-                    // compute the mask and write to the destination
-                    cv::Mat C_thresh_horizontal = ((C>=0)/255);
-                    C_thresh_horizontal.convertTo(C_thresh_horizontal, CV_64F, 1, 0);
-                    M(Rect(0,0,M.rows,overlap)) = M(Rect(0,0,M.rows,overlap)).mul(C_thresh_horizontal);
-                }
-                //std::cout << "M = "<< std::endl << " "  << M << std::endl << std::endl;
-                if((i==0)&&(j==0)) // synthesizing the first one, just copy paste
-                {
-                    input_image(Rect(sub2,sub1,tilesize,tilesize)).copyTo(output_image(Rect(startJ,startI,tilesize,tilesize)));
-                }
-                else
-                {
-                    // write to the destination using the mask
-                    cv::Mat A = output_image(Rect(startJ,startI,endJ-startJ+1,endI-startI+1));
-                    cv::Mat B = input_image(Rect(sub2,sub1,tilesize,tilesize));
+// the ssd of Y against every position of the source over the pixels where _weights is set,
+// exactly: the pixels left out neither count nor need to be non-zero
+cv::Mat ImageQuilting::masked_ssd(const QuiltExemplar &_src, const cv::Mat &_squares, const cv::Mat &Y, const cv::Mat &_weights)
+{
+    int rows = _src.image.rows - Y.rows + 1;
+    int cols = _src.image.cols - Y.cols + 1;
+    cv::Mat W, Z;
+    _weights.convertTo(W, CV_64F, 1.0/255, 0);
+    cv::filter2D(_squares, Z, -1, W, Point(0,0), 0, cv::BORDER_CONSTANT);
+    Z = Z(Rect(0, 0, cols, rows)).clone();
+
+    std::vector<cv::Mat> Y_split;
+    cv::split(Y, Y_split);
+    cv::Mat B, WB, ab_tmp;
+    for(size_t k=0; k<Y_split.size(); k++)
+    {
+        Y_split[k].convertTo(B, CV_64F, 1, 0);
+        WB = W.mul(B);
+        cv::filter2D(_src.planes[k], ab_tmp, -1, WB, Point(0,0), 0, cv::BORDER_CONSTANT);
+        Z = Z - ab_tmp(Rect(0, 0, cols, rows))*2 + WB.dot(B);
+    }
+    return Z;
+}
 
-                    output_image(Rect(startJ,startI,endJ-startJ+1,endI-startI+1)) = filtered_write(A, B, M);
-                }
+// the distances of the sequence mode for every source tile of the first exemplar, stacked per
+// transform: the mean squared error over the overlap plus the weighted one to the previous frame,
+// on the same scale as the local search of run_frame
+cv::Mat ImageQuilting::frame_distances(const cv::Mat &_previous, bool _top, bool _left, double _n_overlap, double _n_tile)
+{
+    QuiltExemplar &src = exemplars[0];
+    if(src.planes.empty())
+    {
+        prepare_planes(src);
+    }
+    int rows = src.image.rows-tilesize;
+    int cols = src.image.cols-tilesize;
 
+    // the left overlap, plus the top overlap, minus the corner they share
+    std::vector<cv::Rect> parts;
+    if(_left)
+    {
+        parts.push_back(Rect(0,0,overlap,tilesize));
+    }
+    if(_top)
+    {
+        parts.push_back(Rect(0,0,tilesize,overlap));
+    }
+    if(_top && _left)
+    {
+        parts.push_back(Rect(0,0,overlap,overlap));
+    }
 
-            }
-            if(!m_useconv)
+    cv::Mat distances(rows*m_transforms, cols, CV_64F);
+    for(int u=0; u<m_transforms; u++)
+    {
+        int inv = dihedral_inverse(u);
+        cv::Mat tmpl, previous_u;
+        dihedral(output_image(Rect(startJ,startI,tilesize,tilesize)), tmpl, inv);
+        dihedral(_previous, previous_u, inv);
+
+        cv::Mat d = distances.rowRange(u*rows, (u+1)*rows);
+        cv::Mat temporal = exact_ssd(src, previous_u)(Rect(0,0,cols,rows))*(m_temporal_weight/_n_tile);
+        temporal.copyTo(d);
+        for(size_t p=0; p<parts.size(); p++)
+        {
+            cv::Rect R = dihedral_rect(parts[p], tilesize, inv);
+            cv::Mat Z = exact_ssd(src, tmpl(R))(Rect(R.x,R.y,cols,rows))/_n_overlap;
+            if(p < 2)
             {
-
+                d += Z;
             }
             else
             {
-                distances.release();
-            }
-
-            candidates.release();
-            Z.release();
-            E.release();
-            C.release();
-            M.release();
-            if(m_show_every_pic)
-            {
-                cv::imshow("output_image", output_image);
-                cv::waitKey();
-                cv::destroyAllWindows();
+                d -= Z;
             }
         }
     }
-    std::cout << "DONE!" << std::endl;
+    return distances;
+}
+
+cv::Mat ImageQuilting::source_ssd(const QuiltExemplar &_src, cv::Mat &Y)
+{
+    if(_src.planes.empty())
+    {
+        cv::Mat X = _src.image;
+        return ssd(X, Y);
+    }
+
+    // the same operations in the same order as ssd(_src.image, Y), so the distances are
+    // identical; only the split, the conversion and the squares of the source are cached
+    int rows = _src.image.rows - Y.rows + 1;
+    int cols = _src.image.cols - Y.cols + 1;
+    cv::Mat K = cv::Mat::ones(Y.rows, Y.cols, CV_64F);
+
+    std::vector<cv::Mat> Y_split;
+    cv::split(Y, Y_split);
+    cv::Mat B, B_2, Z, a2_tmp, ab_tmp;
+    for(size_t k=0; k<Y_split.size(); k++)
+    {
+        cv::filter2D(_src.plane_squares[k], a2_tmp, -1, K, Point(-1,-1), 0, cv::BORDER_CONSTANT);
+        cv::Mat a2 = a2_tmp(Rect(K.cols/2, K.rows/2, cols, rows));
+
+        Y_split[k].convertTo(B, CV_64F, 1, 0);
+        cv::pow(B, 2, B_2);
+        double b2 = cv::sum(B_2)[0];
+
+        // normalize B, because the sum of the filter must be 1
+        cv::normalize(B, B, 0, 1, cv::NORM_MINMAX, CV_64F);
+        cv::filter2D(_src.planes[k], ab_tmp, -1, B, Point(-1,-1), 0, cv::BORDER_CONSTANT);
+        cv::Mat ab = ab_tmp(Rect(B.cols/2, B.rows/2, cols, rows))*2;
+
+        cv::Mat Z_k = (a2 - ab) + b2;
+        Z = (k == 0) ? Z_k : Mat(Z + Z_k);
+    }
+    return Z;
+}
+
+int ImageQuilting::overlap_pixels(bool _top, bool _left)
+{
+    int n = 0;
+    if(_left) n += overlap*tilesize;
+    if(_top) n += overlap*tilesize;
+    if(_top && _left) n -= overlap*overlap;
+    return n;
+}
+
+double ImageQuilting::overlap_distance(int _e, int _sub1, int _sub2, int _t, bool _top, bool _left)
+{
+    // exact ssd of one candidate over the left and top overlap of tile (i,j)
+    cv::Mat B = source_tile(_e, _sub1, _sub2, _t);
+    double d = 0;
+    if(_left)
+    {
+        d += cv::norm(B(Rect(0,0,overlap,tilesize)), output_image(Rect(startJ,startI,overlap,tilesize)), NORM_L2SQR);
+    }
+    if(_top)
+    {
+        d += cv::norm(B(Rect(0,0,tilesize,overlap)), output_image(Rect(startJ,startI,tilesize,overlap)), NORM_L2SQR);
+    }
+    if(_top && _left)
+    {
+        d -= cv::norm(B(Rect(0,0,overlap,overlap)), output_image(Rect(startJ,startI,overlap,overlap)), NORM_L2SQR);
+    }
+    return d;
+}
+
+// the left overlap and the rest of the top overlap of tile (i,j), in tile coordinates
+std::vector<cv::Rect> ImageQuilting::overlap_regions(bool _top, bool _left)
+{
+    std::vector<cv::Rect> regions;
+    if(_left)
+    {
+        regions.push_back(Rect(0,0,overlap,tilesize));
+    }
+    if(_top)
+    {
+        regions.push_back(_left ? Rect(overlap,0,tilesize-overlap,overlap) : Rect(0,0,tilesize,overlap));
+    }
+    return regions;
+}
+
+// the tile at (sub1,sub2) of exemplar e under transform t, a view of the exemplar when t is 0
+cv::Mat ImageQuilting::source_tile(int _e, int _sub1, int _sub2, int _t)
+{
+    cv::Mat B;
+    dihedral(exemplars[_e].image(Rect(_sub2,_sub1,tilesize,tilesize)), B, _t);
+    return B;
+}
 
-    // convert cv::Mat to QImage
-    imgout = mat_to_qimage(output_image);
+bool ImageQuilting::same_source(const TilePlacement &_a, const TilePlacement &_b)
+{
+    return (_a.exemplar == _b.exemplar) && (_a.sub1 == _b.sub1) && (_a.sub2 == _b.sub2) && (_a.transform == _b.transform);
 }
 
 void ImageQuilting::ind2sub(cv::Mat &X, int _idx, int &_sub1, int &_sub2)
@@ -421,17 +1791,16 @@ cv::Mat ImageQuilting::filtered_write(cv::Mat &A, cv::Mat &B, cv::Mat &M)
 {
     cv::Mat R = A;
 
-    cv::Mat A_split[3], B_split[3], R_split[3];
+    std::vector<cv::Mat> A_split, B_split, R_split(A.channels());
     cv::split(A,A_split);
     cv::split(B,B_split);
-    cv::split(R,R_split);
 
     for(int k=0; k<A.channels(); k++)
     {
         R_split[k] = A_split[k].mul((M==0)/255) + B_split[k].mul(((M==1)/255));
     }
 
-    cv::merge(R_split, 3, R);
+    cv::merge(R_split, R);
     return R;
 }
 
@@ -617,10 +1986,3 @@ double ImageQuilting::find_min(cv::Mat X)
     cv::minMaxIdx(X, &_minVal, &_maxVal);
     return _minVal;
 }
-
-void ImageQuilting::initParams( bool _useconv, bool _complex, bool _show_every_pic)
-{
-    m_useconv = _useconv;
-    m_complex = _complex;
-    m_show_every_pic = _show_every_pic;
-}
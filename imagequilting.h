@@ -16,31 +16,167 @@
 #include <fstream>
 #include <queue>
 #include <time.h>
+#include <functional>
+#include <random>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/imgproc/types_c.h>
-#include <QImage>
-#include <QPixmap>
-#include <QDebug>
 #include <vector>
 
 using array2D = std::vector< std::vector< int > >;
 
 using namespace std;
 
+// strided 8-bit image buffer, interleaved channels in BGR(A) order
+struct QuiltBuffer
+{
+    unsigned char *data;
+    int width;
+    int height;
+    int channels;
+    size_t step;   // bytes per row
+};
+
+// parameters of one synthesis run
+struct QuiltParams
+{
+    int tilesize;
+    int num_tiles;
+    int overlap;
+    bool useconv;
+    bool complex;
+    bool show_every_pic;
+    double err;
+    unsigned int seed;
+    bool kernels;               // specialised kernels, false runs the reference code
+    bool prune;                 // skip brute force candidates ruled out by their window statistics
+    bool transforms;            // also search the rotated and mirrored source tiles
+
+    // adaptive mode
+    bool adaptive;              // split tiles whose best match does not fit into quadrants
+    double split_threshold;     // mean squared overlap error above which a tile is split
+    int min_tilesize;           // quadrants are never smaller than this
+
+    std::string placement_log;  // when set, synthesize() writes the placement there (see placementlog.h)
+    std::string checkpoint;     // when set, synthesize() saves its progress there and resumes from it (see checkpoint.h)
+    int checkpoint_rows;        // tile rows between two checkpoints
+
+    // coherence mode
+    bool coherence;             // try the continuations of the left and top neighbours before a full search
+    int coherence_radius;       // continuations are tried this far around the neighbours' offsets
+    int coherence_random;       // random candidates tried along with them
+    double coherence_threshold; // mean squared overlap error above which a tile gets a full search
+
+    // fill mode
+    int fill_margin;            // source tiles are searched this far around the mask, 0 searches the whole image
+
+    // sequence mode
+    int sequence_radius;        // search radius around the previous frame's offset
+    double temporal_weight;     // weight of the difference to the previous frame
+    double sequence_threshold;  // mean squared error above which a tile gets a full search
+
+    QuiltParams()
+        : tilesize(80), num_tiles(5), overlap(13),
+          useconv(true), complex(true), show_every_pic(false),
+          err(0.002), seed(0), kernels(true), prune(true), transforms(false),
+          adaptive(false), split_threshold(200), min_tilesize(16), checkpoint_rows(1),
+          coherence(false), coherence_radius(1), coherence_random(8), coherence_threshold(200), fill_margin(160),
+          sequence_radius(8), temporal_weight(1.0), sequence_threshold(400) {}
+};
+
+// where one tile was taken from, and where it was cut into its neighbours
+struct TilePlacement
+{
+    int sub1;                   // source row
+    int sub2;                   // source column
+    int transform;              // dihedral transform of the source tile, 0 is none (see source_tile)
+    int exemplar;               // the source image the tile was taken from
+    std::vector<int> vcut;      // per row, first column of the left overlap taken from this tile
+    std::vector<int> hcut;      // per column, first row of the top overlap taken from this tile
+    std::vector<TilePlacement> children;    // the four quadrants in raster order when the tile was split
+
+    TilePlacement() : sub1(0), sub2(0), transform(0), exemplar(0) {}
+};
+
+// placement of every tile of one output, in raster order
+struct QuiltPlacement
+{
+    int tilesize;
+    int overlap;
+    int num_tiles;
+    std::vector<TilePlacement> tiles;
+
+    QuiltPlacement() : tilesize(0), overlap(0), num_tiles(0) {}
+};
+
+// one source image of a synthesis, with what the search precomputes for it
+struct QuiltExemplar
+{
+    cv::Mat image;
+    // per channel double planes and their squares, for the convolution search, and the
+    // integral of the squares summed over the channels, for the exact ssd
+    std::vector<cv::Mat> planes;
+    std::vector<cv::Mat> plane_squares;
+    cv::Mat sqsum;
+    // per channel integrals of the image and of its squares, for the pruning bounds
+    cv::Mat window_sum;
+    cv::Mat window_sqsum;
+};
+
+// state carried from one frame of a sequence to the next
+struct QuiltSequence
+{
+    QuiltPlacement placement;
+    cv::Mat previous;           // last output frame
+    int frame;
+
+    QuiltSequence() : frame(0) {}
+};
+
+// called after every tile with (tiles done, total tiles),
+// return false to cancel the synthesis
+typedef std::function<bool(int, int)> QuiltProgress;
+
 class ImageQuilting
 {
 public:
     ImageQuilting();
     ~ImageQuilting();
 
-    void initParams(bool _useconv, bool _simple, bool _show_every_pic);
-    void synthesize(QImage &imgin, QImage &imgout, int _tilesize, int _num_tiles, int _overlap, bool _useconv);
+    // synthesize from a raw buffer with 1, 3 or 4 channels, imgout must be preallocated
+    // with output_size(params) rows and cols and the channels of imgin
+    bool synthesize(const QuiltBuffer &imgin, QuiltBuffer &imgout, const QuiltParams &params, QuiltProgress progress = QuiltProgress());
+    // synthesize from a cv::Mat, imgout is allocated if it does not match
+    bool synthesize(const cv::Mat &imgin, cv::Mat &imgout, const QuiltParams &params, QuiltProgress progress = QuiltProgress());
+    // synthesize from several exemplars of the same type and any size, searched as one pool
+    bool synthesize(const std::vector<cv::Mat> &imgin, cv::Mat &imgout, const QuiltParams &params, QuiltProgress progress = QuiltProgress());
+    bool synthesize(const std::vector<QuiltBuffer> &imgin, QuiltBuffer &imgout, const QuiltParams &params, QuiltProgress progress = QuiltProgress());
+    // synthesize the next frame of an animated texture, every tile first searches
+    // around its previous offset and falls back to a full search when that is not
+    // good enough; an empty sequence starts with a normal synthesis
+    bool synthesize_frame(const QuiltBuffer &imgin, QuiltBuffer &imgout, const QuiltParams &params, QuiltSequence &sequence, QuiltProgress progress = QuiltProgress());
+    bool synthesize_frame(const cv::Mat &imgin, cv::Mat &imgout, const QuiltParams &params, QuiltSequence &sequence, QuiltProgress progress = QuiltProgress());
+    // synthesize on top of a previous result and its placement: only tiles outside
+    // the previous grid and tiles in region (in tile coordinates, x is the column)
+    // are searched again, plus new seams for the tiles cut against them
+    bool resynthesize(const cv::Mat &imgin, const cv::Mat &previous, const QuiltPlacement &last, cv::Mat &imgout, const QuiltParams &params, const cv::Rect &region = cv::Rect(), QuiltProgress progress = QuiltProgress());
+    // rebuild an output from its source and placement in one pass, without any search
+    bool render(const cv::Mat &imgin, const QuiltPlacement &_placement, cv::Mat &imgout);
+    bool render(const std::vector<cv::Mat> &imgin, const QuiltPlacement &_placement, cv::Mat &imgout);
+    // same from a placement log written by synthesize()
+    bool render(const cv::Mat &imgin, const std::string &_log, cv::Mat &imgout);
+    bool render(const std::vector<cv::Mat> &imgin, const std::string &_log, cv::Mat &imgout);
+    // fill the pixels of image where mask (8-bit, one channel) is non-zero: only the tiles
+    // of a grid over image that touch the mask are synthesized, matched against the known
+    // pixels around them and taken from the undamaged part of image; imgout has the size
+    // of image and may be image itself
+    bool fill(const cv::Mat &image, const cv::Mat &mask, cv::Mat &imgout, const QuiltParams &params, QuiltProgress progress = QuiltProgress());
     cv::Mat getxcorr2(cv::Mat &imgA, cv::Mat &imgB);
 
-    cv::Mat qimage_to_mat(QImage &imgin, bool inCloneImageData);
-    QImage mat_to_qimage(cv::Mat &mat);
+    static int output_size(const QuiltParams &params);
+    // placement of the last synthesis
+    const QuiltPlacement &last_placement() const { return placement; }
 
 
     // utility functions
@@ -57,6 +193,49 @@ public:
     double myssd(cv::Mat &X);
 
 private:
+    bool prepare(const cv::Mat &imgin, cv::Mat &imgout, const QuiltParams &params);
+    bool prepare(const std::vector<cv::Mat> &imgin, cv::Mat &imgout, const QuiltParams &params);
+    bool run(QuiltProgress &progress);
+    bool run_frame(const QuiltSequence &sequence, QuiltProgress &progress);
+    bool run_adaptive(QuiltProgress &progress);
+    bool run_fill(const cv::Mat &_mask, const cv::Rect &_region, QuiltProgress &progress);
+    void fill_tile(const TilePlacement &_tile, cv::Mat &_unknown);
+    bool coherent_tile(int _i, int _j, TilePlacement &_tile);
+    void adaptive_tile(bool _top, bool _left, TilePlacement &_tile, int &_searches);
+    int subtile_size(int _size);
+    static bool has_splits(const QuiltPlacement &_placement);
+    static bool single_exemplar(const QuiltPlacement &_placement);
+    bool valid_tile(const TilePlacement &_tile, int _size);
+    bool resume();
+    void checkpoint_row(int _i);
+
+    // per tile steps of the synthesis
+    // the steps below work on the current tile, placed by set_tile or set_slot;
+    // _top and _left tell which of its overlaps are already written
+    void set_tile(int _i, int _j);
+    void set_slot(int _y, int _x, int _size);
+    std::vector<cv::Mat> tile_distances(bool _top, bool _left, bool _prune = true);
+    cv::Mat transform_distances(int _e, bool _top, bool _left, int _t, bool _prune, int &_evaluated, int &_candidates);
+    bool pruned_distances(const QuiltExemplar &_src, const cv::Mat &tmpl, const std::vector<cv::Rect> &regions, cv::Mat &distances,
+                          int &_evaluated, int &_candidates);
+    double pick_tile(std::vector<cv::Mat> &distances, TilePlacement &_tile, int _transforms = 1);
+    void compute_seams(bool _top, bool _left, TilePlacement &_tile);
+    void paste_tile(const TilePlacement &_tile);
+    bool finish_tile(int _done, int _total, QuiltProgress &progress);
+
+    cv::Mat source_ssd(const QuiltExemplar &_src, cv::Mat &Y);
+    cv::Mat exact_ssd(const QuiltExemplar &_src, const cv::Mat &Y);
+    cv::Mat masked_ssd(const QuiltExemplar &_src, const cv::Mat &_squares, const cv::Mat &Y, const cv::Mat &_weights);
+    cv::Mat frame_distances(const cv::Mat &_previous, bool _top, bool _left, double _n_overlap, double _n_tile);
+    cv::Mat source_tile(int _e, int _sub1, int _sub2, int _t);
+    std::vector<int> cut_positions(cv::Mat &C, int _direction);
+    cv::Mat overlap_energy(const cv::Mat &_a, const cv::Mat &_b);
+    int overlap_pixels(bool _top, bool _left);
+    double overlap_distance(int _e, int _sub1, int _sub2, int _t, bool _top, bool _left);
+    std::vector<cv::Rect> overlap_regions(bool _top, bool _left);
+    static bool same_source(const TilePlacement &_a, const TilePlacement &_b);
+
+    // the first exemplar, the sequence mode and resynthesize() only have this one
     cv::Mat input_image;
     cv::Mat output_image;
     int tilesize;
@@ -77,12 +256,36 @@ private:
     int output_height;
 
     cv::Rect roi;
-    cv::Mat output_image_roi;
     cv::Mat input_image_roi;
 
     int m_useconv;
     int m_complex;
     int m_show_every_pic;
+    int m_kernels;
+    int m_prune;
+    int m_transforms;           // number of transforms searched, 1 or 8
+    int m_adaptive;
+    double m_split_threshold;
+    int m_min_tilesize;
+    int m_sequence_radius;
+    double m_temporal_weight;
+    double m_sequence_threshold;
+    int m_coherence;
+    int m_coherence_radius;
+    int m_coherence_random;
+    double m_coherence_threshold;
+
+    // checkpoints of synthesize(), off for the other modes
+    std::string m_checkpoint;
+    int m_checkpoint_rows;
+    std::string m_checkpoint_key;
+    int m_first_row;            // tile rows restored from a checkpoint
+
+    // the sources, prepared once per synthesis
+    std::vector<QuiltExemplar> exemplars;
+
+    QuiltPlacement placement;
+    std::mt19937 rng;
 };
 
 #endif // IMAGEQUILTING_H
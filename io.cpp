@@ -7,11 +7,20 @@
  */
 
 #include <QtWidgets>
+#include <QtConcurrent>
 #include <io.h>
+#include <rowencoder.h>
+
+// longest side of the preview output, in pixels
+static const int PREVIEW_SIZE = 256;
+// longest side of the source the preview searches, in pixels
+static const int MAX_PREVIEW_SOURCE = 256;
+// quiet time after the last slider move before a preview starts, in ms
+static const int PREVIEW_DELAY = 150;
 
 // construct the form
 IO::IO(QWidget *parent)
-    : QWidget(parent)
+    : QWidget(parent), preview_generation(0), preview_dirty(false)
 {
     // define QPushButton objects
     loadButton = new QPushButton(tr("&Load Image"));
@@ -42,6 +51,8 @@ IO::IO(QWidget *parent)
     resImage->setFrameStyle(QFrame::Panel | QFrame::Sunken);
     resImage->setFixedSize(516,387);
     resImage->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Preferred);
+    resImage->setToolTip(tr("Click a tile to synthesize it again"));
+    resImage->installEventFilter(this);
 
     convCheckBox = new QCheckBox(tr("Use Convolution"));
     convCheckBox->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
@@ -49,10 +60,23 @@ IO::IO(QWidget *parent)
     complexCheckBox = new QCheckBox(tr("With Mincut"));
     complexCheckBox->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
     complexCheckBox->setChecked(true);
+    transformCheckBox = new QCheckBox(tr("Rotate/Mirror Tiles"));
+    transformCheckBox->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+    transformCheckBox->setChecked(false);
+    previewCheckBox = new QCheckBox(tr("Live Preview"));
+    previewCheckBox->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+    previewCheckBox->setChecked(true);
     debugCheckBox = new QCheckBox(tr("Show Process"));
     debugCheckBox->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
     debugCheckBox->setChecked(false);
 
+    levelSpinBox = new QSpinBox;
+    levelSpinBox->setRange(0,9);
+    levelSpinBox->setValue(6);
+    levelSpinBox->setPrefix(tr("PNG Level "));
+    levelSpinBox->setToolTip(tr("PNG compression, 0 stores the pixels and is fastest"));
+    levelSpinBox->setFixedWidth(100);
+
     tileSize = new QLabel(tr("Tile Size"));
     tileSize->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Minimum);
     overlapRegion = new QLabel(tr("Overlap Region"));
@@ -98,6 +122,8 @@ IO::IO(QWidget *parent)
     connect(loadButton, SIGNAL(clicked()), this, SLOT(loadImageButton()));
     connect(synButton, SIGNAL(clicked()), this, SLOT(synthesizeImageButton()));
     connect(saveButton, SIGNAL(clicked()), this, SLOT(saveImageButton()));
+    saveWatcher = new QFutureWatcher<bool>(this);
+    connect(saveWatcher, SIGNAL(finished()), this, SLOT(saveFinished()));
     connect(resetButton, SIGNAL(clicked()), this, SLOT(resetAllButton()));
     connect(tileSizeSpinBox, SIGNAL(valueChanged(int)), tileSizeBar, SLOT(setValue(int)));
     connect(tileSizeBar, SIGNAL(valueChanged(int)), tileSizeSpinBox, SLOT(setValue(int)));
@@ -109,11 +135,28 @@ IO::IO(QWidget *parent)
     connect(numTileBar, SIGNAL(valueChanged(int)), numTileSpinBox, SLOT(setValue(int)));
     numTileSpinBox->setValue(5);
 
+    // preview the result while the parameters change, full resolution once a slider is released
+    previewTimer = new QTimer(this);
+    previewTimer->setSingleShot(true);
+    previewTimer->setInterval(PREVIEW_DELAY);
+    previewWatcher = new QFutureWatcher<PreviewResult>(this);
+    connect(previewTimer, SIGNAL(timeout()), this, SLOT(startPreview()));
+    connect(previewWatcher, SIGNAL(finished()), this, SLOT(showPreview()));
+    synthesisWatcher = new QFutureWatcher<SynthesisResult>(this);
+    connect(synthesisWatcher, SIGNAL(finished()), this, SLOT(showSynthesis()));
+    connect(tileSizeSpinBox, SIGNAL(valueChanged(int)), this, SLOT(schedulePreview()));
+    connect(overlapRegionSpinBox, SIGNAL(valueChanged(int)), this, SLOT(schedulePreview()));
+    connect(numTileSpinBox, SIGNAL(valueChanged(int)), this, SLOT(schedulePreview()));
+    connect(tileSizeBar, SIGNAL(sliderReleased()), this, SLOT(finishPreview()));
+    connect(overlapRegionBar, SIGNAL(sliderReleased()), this, SLOT(finishPreview()));
+    connect(numTileBar, SIGNAL(sliderReleased()), this, SLOT(finishPreview()));
+
     // vertical button layout
     QVBoxLayout *buttonLayout1 = new QVBoxLayout;
     buttonLayout1->addWidget(loadButton);
     buttonLayout1->addWidget(synButton);
     buttonLayout1->addWidget(saveButton);
+    buttonLayout1->addWidget(levelSpinBox);
     buttonLayout1->addWidget(resetButton);
     buttonLayout1->setSpacing(15);
 
@@ -121,7 +164,9 @@ IO::IO(QWidget *parent)
     toolsLayout1->addWidget(srcImage, 0, 0, Qt::AlignTop);
     toolsLayout1->addWidget(convCheckBox, 1, 0, Qt::AlignLeft);
     toolsLayout1->addWidget(complexCheckBox, 2, 0, Qt::AlignLeft);
-    toolsLayout1->addWidget(debugCheckBox, 3, 0, Qt::AlignLeft);
+    toolsLayout1->addWidget(transformCheckBox, 3, 0, Qt::AlignLeft);
+    toolsLayout1->addWidget(previewCheckBox, 4, 0, Qt::AlignLeft);
+    toolsLayout1->addWidget(debugCheckBox, 5, 0, Qt::AlignLeft);
 
     QGridLayout *toolsLayout2 = new QGridLayout;
     //toolsLayout->addWidget(convCheckBox, 0, 1);
@@ -151,6 +196,153 @@ IO::IO(QWidget *parent)
     mainLayout->setSizeConstraint(QLayout::SetFixedSize);
     setLayout(mainLayout);
     setWindowTitle(tr("Image Quilting"));
+
+    // cost model and limits for the admission control
+    costmodel.load("parameters.xml");
+}
+
+cv::Mat IO::qimage_to_mat(QImage &imgin, bool inCloneImageData)
+{
+    switch ( imgin.format() )
+     {
+        // 8-bit, 4 channel, the synthesis blends straight alpha
+        case QImage::Format_ARGB32_Premultiplied:
+        {
+           QImage   straight = imgin.convertToFormat( QImage::Format_ARGB32 );
+           return qimage_to_mat( straight, true );
+        }
+
+        case QImage::Format_ARGB32:
+        {
+           cv::Mat  mat( imgin.height(), imgin.width(),
+                         CV_8UC4,
+                         const_cast<uchar*>(imgin.bits()),
+                         static_cast<size_t>(imgin.bytesPerLine())
+                         );
+
+           return (inCloneImageData ? mat.clone() : mat);
+        }
+
+        // 8-bit, 3 channel
+        case QImage::Format_RGB32:
+        case QImage::Format_RGB888:
+        {
+           if ( !inCloneImageData )
+           {
+              qWarning() << "IO::qimage_to_mat() - Conversion requires cloning because we use a temporary QImage";
+           }
+
+           QImage   swapped = imgin;
+
+           if ( imgin.format() == QImage::Format_RGB32 )
+           {
+              swapped = swapped.convertToFormat( QImage::Format_RGB888 );
+           }
+
+           swapped = swapped.rgbSwapped();
+
+           return cv::Mat( swapped.height(), swapped.width(),
+                           CV_8UC3,
+                           const_cast<uchar*>(swapped.bits()),
+                           static_cast<size_t>(swapped.bytesPerLine())
+                           ).clone();
+        }
+
+        // 8-bit, 1 channel
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+        case QImage::Format_Grayscale8:
+#endif
+        case QImage::Format_Indexed8:
+        {
+           // a palette of colours is synthesized in colour
+           if ( (imgin.format() == QImage::Format_Indexed8) && !imgin.isGrayscale() )
+           {
+              QImage   expanded = imgin.convertToFormat( imgin.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32 );
+              return qimage_to_mat( expanded, true );
+           }
+
+           cv::Mat  mat( imgin.height(), imgin.width(),
+                         CV_8UC1,
+                         const_cast<uchar*>(imgin.bits()),
+                         static_cast<size_t>(imgin.bytesPerLine())
+                         );
+
+           return (inCloneImageData ? mat.clone() : mat);
+        }
+
+        default:
+           qWarning() << "IO::qimage_to_mat() - QImage format not handled in switch:" << imgin.format();
+           break;
+     }
+
+     return cv::Mat();
+}
+
+QImage IO::mat_to_qimage(cv::Mat &mat)
+{
+    // NOTE: This does not cover all cases - it should be easy to add new ones as required.
+    switch ( mat.type() )
+    {
+        // 8-bit, 4 channel
+        case CV_8UC4:
+        {
+            QImage image( mat.data,
+                       mat.cols, mat.rows,
+                       static_cast<int>(mat.step),
+                       QImage::Format_ARGB32 );
+
+            return image;
+        }
+
+        // 8-bit, 3 channel
+        case CV_8UC3:
+        {
+            QImage image( mat.data,
+                       mat.cols, mat.rows,
+                       static_cast<int>(mat.step),
+                       QImage::Format_RGB888 );
+
+            return image.rgbSwapped();
+        }
+
+        // 8-bit, 1 channel
+        case CV_8UC1:
+        {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+            QImage image( mat.data,
+                       mat.cols, mat.rows,
+                       static_cast<int>(mat.step),
+                       QImage::Format_Grayscale8 );
+#else
+            static QVector<QRgb>  sColorTable;
+
+            // only create our color table the first time
+            if ( sColorTable.isEmpty() )
+            {
+                sColorTable.resize( 256 );
+
+                for ( int i = 0; i < 256; ++i )
+                {
+                    sColorTable[i] = qRgb( i, i, i );
+                }
+            }
+
+            QImage image( mat.data,
+                       mat.cols, mat.rows,
+                       static_cast<int>(mat.step),
+                       QImage::Format_Indexed8 );
+
+            image.setColorTable( sColorTable );
+#endif
+
+            return image;
+        }
+
+        default:
+            qWarning() << "IO::mat_to_qimage() - cv::Mat image type not handled in switch:" << mat.type();
+            break;
+    }
+    return QImage();
 }
 
 // load texture image button
@@ -194,35 +386,144 @@ void IO::loadImageButton()
 
         // load image in self-defined "Image" format
         input_image = image.toImage();
+        source_mat = qimage_to_mat(input_image);
+        result_mat.release();
+
+        // a preview of the previous source must not show up
+        previewTimer->stop();
+        ++preview_generation;
+        preview_dirty = false;
     }
     synButton->setEnabled(true);
     resetButton->setEnabled(true);
 }
 
+IO::~IO()
+{
+    // let a running preview stop at its next tile before the form goes away
+    ++preview_generation;
+    previewWatcher->waitForFinished();
+    synthesisWatcher->waitForFinished();
+    saveWatcher->waitForFinished();
+}
+
+QuiltParams IO::readParams()
+{
+    // get the tilesize and overlap region value
+    QuiltParams params;
+    params.tilesize = tileSizeSpinBox->value(); // get tile size
+    params.overlap = overlapRegionSpinBox->value(); // get overlap region
+    params.num_tiles = numTileSpinBox->value();
+    params.useconv = convCheckBox->isChecked();
+    params.complex = complexCheckBox->isChecked();
+    params.transforms = transformCheckBox->isChecked();
+    params.show_every_pic = debugCheckBox->isChecked();
+    params.seed = time(NULL);
+    return params;
+}
+
+// a changed number of tiles only synthesizes the tiles that were added or cut
+bool IO::canGrow(const QuiltParams &params)
+{
+    return !result_mat.empty() &&
+           (params.tilesize == result_params.tilesize) && (params.overlap == result_params.overlap) &&
+           (params.useconv == result_params.useconv) && (params.complex == result_params.complex) &&
+           (params.num_tiles != result_params.num_tiles);
+}
+
 void IO::synthesizeImageButton()
 {
     QElapsedTimer timer;
-    srand(time(NULL)); // must call srand() first
     std::cout << "synthesizing" << std::endl;
 
-    // get the tilesize and overlap region value
-    int tilesize = tileSizeSpinBox->value(); // get tile size
-    int overlap = overlapRegionSpinBox->value(); // get overlap region
-    int num_tiles = numTileSpinBox->value();
-    bool useconv = convCheckBox->isChecked();
-    bool complex = complexCheckBox->isChecked();
-    bool debug = debugCheckBox->isChecked();
+    // a full synthesis makes any pending preview stale
+    previewTimer->stop();
+    ++preview_generation;
+    preview_dirty = false;
+
+    QuiltParams params = readParams();
+
+    // check the predicted cost against the limits before starting
+    CostEstimate estimate;
+    AdmissionDecision decision = costmodel.admit(source_mat.rows, source_mat.cols, source_mat.channels(), params, cv::getNumThreads(), estimate);
+    QString cost_info = tr("predicted %1 s and %2 MB").arg(estimate.seconds, 0, 'f', 1).arg(estimate.bytes/1e6, 0, 'f', 0);
+    if(decision == ADMIT_REJECT)
+    {
+        QMessageBox::warning(this, tr("Job too expensive!"), cost_info + tr(", over the configured limits."));
+        return;
+    }
+    if(decision == ADMIT_DOWNGRADE)
+    {
+        QMessageBox::information(this, tr("Job downgraded"), cost_info + tr(" after switching to a cheaper mode."));
+        convCheckBox->setChecked(params.useconv);
+        complexCheckBox->setChecked(params.complex);
+    }
 
-    // initialize variables in imagequilting
-    imagequilting.initParams(useconv, complex, debug);
+    bool grow = canGrow(params);
 
     // start synthesizing
     timer.start();
-    imagequilting.synthesize(input_image, output_image, tilesize, num_tiles, overlap, useconv);
+    cv::Mat res;
+    bool ok;
+    if(grow)
+    {
+        ok = imagequilting.resynthesize(source_mat, result_mat, result_placement, res, params);
+    }
+    else
+    {
+        ok = imagequilting.synthesize(source_mat, res, params);
+    }
+    if(!ok)
+    {
+        QMessageBox::information(this, tr("Unable to synthesize!"), tr("Invalid parameters for this source image."));
+        return;
+    }
+
+    result_mat = res;
+    result_params = params;
+    result_placement = imagequilting.last_placement();
+    showResult(timer.elapsed());
+}
+
+// re-roll the tile under the cursor when the result image is clicked
+bool IO::eventFilter(QObject *obj, QEvent *event)
+{
+    if( (obj != resImage) || (event->type() != QEvent::MouseButtonPress) || result_mat.empty() )
+        return QWidget::eventFilter(obj, event);
+
+    QMouseEvent *mouse = static_cast<QMouseEvent*>(event);
+    int x = mouse->pos().x()*result_mat.cols/resImage->width();
+    int y = mouse->pos().y()*result_mat.rows/resImage->height();
+    int step = result_params.tilesize - result_params.overlap;
+    int j = std::min(x/step, result_params.num_tiles-1);
+    int i = std::min(y/step, result_params.num_tiles-1);
+    std::cout << "re-rolling tile [" << i << "," << j << "]" << std::endl;
+
+    previewTimer->stop();
+    ++preview_generation;
+
+    QElapsedTimer timer;
+    timer.start();
+    QuiltParams params = result_params;
+    params.seed = time(NULL);
+    cv::Mat res;
+    if(imagequilting.resynthesize(source_mat, result_mat, result_placement, res, params, cv::Rect(j,i,1,1)))
+    {
+        result_mat = res;
+        result_params = params;
+        result_placement = imagequilting.last_placement();
+        showResult(timer.elapsed());
+    }
+    return true;
+}
+
+void IO::showResult(qint64 elapsed)
+{
+    output_image = mat_to_qimage(result_mat);
 
     // print the information
     QString str = QString::fromStdString("  ms");
-    QString compute_info = QString::number(timer.elapsed()) + str;
+    QString compute_info = QString::number(elapsed) + str;
     comInfo->setText(compute_info);
     comInfo->setScaledContents(true);
     comInfo->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
@@ -245,21 +546,174 @@ void IO::synthesizeImageButton()
     saveButton->setEnabled(true);
 }
 
+void IO::schedulePreview()
+{
+    if( source_mat.empty() || !previewCheckBox->isChecked() )
+        return;
+
+    // restart the wait on every change, the preview runs once the sliders rest
+    preview_dirty = true;
+    previewTimer->start();
+}
+
+void IO::startPreview()
+{
+    if(source_mat.empty())
+        return;
+
+    // quilt a proxy small enough to keep up with the sliders, the tiles shrink with the source;
+    // both the output and the searched source are bounded, either can dominate the cost
+    QuiltParams params = readParams();
+    double scale = std::min(1.0, std::min((double)PREVIEW_SIZE/ImageQuilting::output_size(params),
+                                          (double)MAX_PREVIEW_SOURCE/std::max(source_mat.rows, source_mat.cols)));
+    cv::Mat proxy = source_mat;
+    if(scale < 1)
+    {
+        cv::resize(source_mat, proxy, cv::Size(), scale, scale, cv::INTER_AREA);
+        params.tilesize = std::max(3, (int)std::round(params.tilesize*scale));
+        params.overlap = std::max(1, std::min(params.tilesize-1, (int)std::round(params.overlap*scale)));
+    }
+    params.useconv = true;
+    params.show_every_pic = false;
+
+    int generation = ++preview_generation;
+    std::atomic<int> *current = &preview_generation;
+    previewWatcher->setFuture(QtConcurrent::run([=]() -> PreviewResult
+    {
+        PreviewResult result;
+        result.generation = generation;
+
+        QElapsedTimer timer;
+        timer.start();
+        ImageQuilting quilting;
+        // a newer preview or a full synthesis cancels this one at the next tile
+        QuiltProgress progress = [=](int, int) { return current->load() == generation; };
+        if(!quilting.synthesize(proxy, result.image, params, progress))
+        {
+            result.image.release();
+        }
+        result.elapsed = timer.elapsed();
+        return result;
+    }));
+}
+
+void IO::showPreview()
+{
+    PreviewResult result = previewWatcher->result();
+    if( (result.generation != preview_generation) || result.image.empty() )
+        return;
+
+    // the label scales the proxy up to the size of the result
+    QPixmap image = QPixmap::fromImage(mat_to_qimage(result.image));
+    resImage->clear();
+    resImage->setPixmap(image);
+    resImage->setScaledContents(true);
+    comInfo->setText(QString::number(result.elapsed) + tr("  ms (preview)"));
+}
+
+void IO::finishPreview()
+{
+    // the full resolution result once the slider is let go, on a worker thread like the preview
+    if( !preview_dirty || source_mat.empty() || !previewCheckBox->isChecked() )
+        return;
+    previewTimer->stop();
+    preview_dirty = false;
+
+    // no dialogs while dragging, a job over the limits keeps the preview
+    QuiltParams params = readParams();
+    params.show_every_pic = false;
+    CostEstimate estimate;
+    if(costmodel.admit(source_mat.rows, source_mat.cols, source_mat.channels(), params, cv::getNumThreads(), estimate) == ADMIT_REJECT)
+    {
+        comInfo->setText(tr("over the configured limits, press Synthesize"));
+        return;
+    }
+    convCheckBox->setChecked(params.useconv);
+    complexCheckBox->setChecked(params.complex);
+
+    bool grow = canGrow(params);
+    cv::Mat source = source_mat;
+    cv::Mat previous = result_mat.clone();
+    QuiltPlacement last = result_placement;
+    int generation = ++preview_generation;
+    std::atomic<int> *current = &preview_generation;
+    synthesisWatcher->setFuture(QtConcurrent::run([=]() -> SynthesisResult
+    {
+        SynthesisResult result;
+        result.generation = generation;
+        result.params = params;
+
+        QElapsedTimer timer;
+        timer.start();
+        ImageQuilting quilting;
+        QuiltProgress progress = [=](int, int) { return current->load() == generation; };
+        bool ok = grow ? quilting.resynthesize(source, previous, last, result.image, params, cv::Rect(), progress)
+                       : quilting.synthesize(source, result.image, params, progress);
+        if(ok)
+        {
+            result.placement = quilting.last_placement();
+        }
+        else
+        {
+            result.image.release();
+        }
+        result.elapsed = timer.elapsed();
+        return result;
+    }));
+}
+
+void IO::showSynthesis()
+{
+    SynthesisResult result = synthesisWatcher->result();
+    if( (result.generation != preview_generation) || result.image.empty() )
+        return;
+
+    result_mat = result.image;
+    result_params = result.params;
+    result_placement = result.placement;
+    showResult(result.elapsed);
+}
+
 void IO::saveImageButton()
 {
     std::cout << "saving" << std::endl;
 
     QString filename = QFileDialog::getSaveFileName(this,
                        tr("Save result image"), "/home/kevin/research/texture/image_quilting/resImage",
-                       tr("Image Files (*.png *.jpg *.bmp)"));
+                       tr("Image Files (*.png *.ppm *.pgm *.pam *.raw)"));
 
-    if(filename.isEmpty())
+    if( filename.isEmpty() || result_mat.empty() )
         return;
-    if(!filename.endsWith(".png"))
+    std::string path = filename.toStdString();
+    std::string format = RowEncoder::format_of(path);
+    if(format.empty())
+    {
+        path += ".png";
+        format = "png";
+    }
+
+    // encode on a worker thread, the form stays usable while a large result is written
+    cv::Mat res = result_mat.clone();
+    int level = levelSpinBox->value();
+    saveButton->setEnabled(false);
+    saveWatcher->setFuture(QtConcurrent::run([=]() -> bool
+    {
+        std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+        RowEncoder encoder;
+        if( !file || !encoder.open(file, format, res.rows, res.cols, res.channels(), level) )
+            return false;
+        encoder.push(res);
+        return encoder.close();
+    }));
+}
+
+void IO::saveFinished()
+{
+    saveButton->setEnabled(!result_mat.empty());
+    if(!saveWatcher->result())
     {
-        filename.append(".png");
+        QMessageBox::information(this, tr("Unable to save!"), tr("The result could not be written, see the console."));
     }
-    output_image.save(filename, "PNG");
 }
 
 void IO::resetAllButton()
@@ -268,6 +722,11 @@ void IO::resetAllButton()
 
     srcImage->setText("Source Image");
     resImage->setText("Result Image");
+    source_mat.release();
+    result_mat.release();
+    previewTimer->stop();
+    ++preview_generation;
+    preview_dirty = false;
 
     synButton->setEnabled(false);
     saveButton->setEnabled(false);
@@ -11,6 +11,8 @@
 
 #include <QWidget>
 #include <QMap>
+#include <QFutureWatcher>
+#include <atomic>
 #include <stdio.h>
 #include <stdlib.h>
 #include <iostream>
@@ -20,6 +22,7 @@
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <imagequilting.h>
+#include <costmodel.h>
 
 
 class QPushButton;
@@ -28,6 +31,25 @@ class QLabel;
 class QSlider;
 class QSpinBox;
 class QCheckBox;
+class QTimer;
+
+// a finished low resolution preview
+struct PreviewResult
+{
+    int generation;     // the preview it belongs to, older ones are dropped
+    cv::Mat image;
+    qint64 elapsed;
+};
+
+// a finished full resolution synthesis started by releasing a slider
+struct SynthesisResult
+{
+    int generation;     // as for the preview
+    cv::Mat image;
+    QuiltParams params;
+    QuiltPlacement placement;
+    qint64 elapsed;
+};
 
 class IO : public QWidget
 {
@@ -35,6 +57,7 @@ class IO : public QWidget
 
 public:
     IO(QWidget *parent = 0);
+    ~IO();
 
 public slots:
     void loadImageButton();
@@ -42,8 +65,27 @@ public slots:
     void synthesizeImageButton();
     void resetAllButton();
 
+private slots:
+    void schedulePreview();
+    void startPreview();
+    void showPreview();
+    void finishPreview();
+    void showSynthesis();
+    void saveFinished();
+
+protected:
+    bool eventFilter(QObject *obj, QEvent *event);
+
 private:
+    QuiltParams readParams();
+    bool canGrow(const QuiltParams &params);
+    void showResult(qint64 elapsed);
+
+    cv::Mat qimage_to_mat(QImage &imgin, bool inCloneImageData = true);
+    QImage mat_to_qimage(cv::Mat &mat);
+
     ImageQuilting imagequilting;
+    CostModel costmodel;
 
     QPushButton *loadButton;
     QPushButton *saveButton;
@@ -52,6 +94,8 @@ private:
 
     QCheckBox *convCheckBox;
     QCheckBox *complexCheckBox;
+    QCheckBox *transformCheckBox;
+    QCheckBox *previewCheckBox;
     QCheckBox *debugCheckBox;
 
     QLabel *srcImage;
@@ -72,10 +116,29 @@ private:
     QSpinBox *overlapRegionSpinBox;
     QSlider *numTileBar;
     QSpinBox *numTileSpinBox;
+    QSpinBox *levelSpinBox;
 
     QImage input_image;
     QImage output_image;
 
+    // the source converted once on load, and the last result with its placement
+    cv::Mat source_mat;
+    cv::Mat result_mat;
+    QuiltParams result_params;
+    QuiltPlacement result_placement;
+
+    // live preview, debounced by the timer and run on a worker thread; every new
+    // preview or full synthesis bumps the generation, which cancels stale runs
+    QTimer *previewTimer;
+    QFutureWatcher<PreviewResult> *previewWatcher;
+    std::atomic<int> preview_generation;
+    bool preview_dirty;     // the parameters changed since the last full synthesis
+    // the full resolution pass after a slider is released, cancelled the same way
+    QFutureWatcher<SynthesisResult> *synthesisWatcher;
+
+    // the result is encoded and written on a worker thread
+    QFutureWatcher<bool> *saveWatcher;
+
 };
 
 
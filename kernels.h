@@ -0,0 +1,188 @@
+/*
+ * Specialised inner loops of the synthesis
+ *
+ * The kernels are templated on the number of channels (CN) and, for the
+ * brute force search, on the overlap width (OV), so the compiler can unroll
+ * and vectorize them. 0 means the value is only known at run time. The
+ * select_* functions pick a specialisation and fall back to the generic one.
+ *
+ */
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <opencv2/core/core.hpp>
+
+// masked ssd of the template against every tilesize X tilesize window of the
+// source, only non-zero (already written) template values count. The written
+// pixels are expected in the top ov rows and the left ov columns, pass
+// ov = tilesize when they may be anywhere.
+template<int CN, int OV>
+void brute_distances(const cv::Mat &src, const cv::Mat &tmpl, int _ov, cv::Mat &dist)
+{
+    const int cn = CN ? CN : src.channels();
+    const int ov = OV ? OV : _ov;
+    const int ts = tmpl.rows;
+    const int wide = ts*cn;     // elements of a row in the top overlap
+    const int narrow = ov*cn;   // elements of a row in the left overlap
+
+    // template values and their 0/1 weights, row by row
+    std::vector<int> t(ts*wide), w(ts*wide);
+    for(int r=0; r<ts; r++)
+    {
+        const uchar *p = tmpl.ptr<uchar>(r);
+        for(int k=0; k<wide; k++)
+        {
+            t[r*wide+k] = p[k];
+            w[r*wide+k] = (p[k] > 0);
+        }
+    }
+
+    for(int a=0; a<dist.rows; a++)
+    {
+        double *d = dist.ptr<double>(a);
+        for(int b=0; b<dist.cols; b++)
+        {
+            long long sum = 0;
+            for(int r=0; r<ts; r++)
+            {
+                const uchar *s = src.ptr<uchar>(a+r) + b*cn;
+                const int *tr = &t[r*wide];
+                const int *wr = &w[r*wide];
+                int acc = 0;
+                if(r < ov)
+                {
+                    for(int k=0; k<wide; k++)
+                    {
+                        int e = (s[k] - tr[k])*wr[k];
+                        acc += e*e;
+                    }
+                }
+                else
+                {
+                    for(int k=0; k<narrow; k++)
+                    {
+                        int e = (s[k] - tr[k])*wr[k];
+                        acc += e*e;
+                    }
+                }
+                sum += acc;
+            }
+            d[b] = (double)sum;
+        }
+    }
+}
+
+// per pixel sum of the squared channels, as a CV_64F image
+template<int CN>
+void square_sum(const cv::Mat &src, cv::Mat &dst)
+{
+    const int cn = CN ? CN : src.channels();
+    dst.create(src.rows, src.cols, CV_64F);
+    for(int r=0; r<src.rows; r++)
+    {
+        const uchar *s = src.ptr<uchar>(r);
+        double *d = dst.ptr<double>(r);
+        for(int c=0; c<src.cols; c++)
+        {
+            int acc = 0;
+            for(int k=0; k<cn; k++)
+            {
+                acc += s[c*cn+k]*s[c*cn+k];
+            }
+            d[c] = acc;
+        }
+    }
+}
+
+// write the tile B over A, left of the vertical cut and above the horizontal
+// cut A is kept, empty cuts mean no seam on that side
+template<int CN>
+void paste_cuts(const cv::Mat &B, const std::vector<int> &vcut, const std::vector<int> &hcut, cv::Mat &A)
+{
+    const int cn = CN ? CN : B.channels();
+    const int ts = B.rows;
+    int top = 0;
+    for(size_t c=0; c<hcut.size(); c++)
+    {
+        top = std::max(top, hcut[c]);
+    }
+
+    for(int r=0; r<ts; r++)
+    {
+        const uchar *b = B.ptr<uchar>(r);
+        uchar *a = A.ptr<uchar>(r);
+        int first = vcut.empty() ? 0 : vcut[r];
+
+        if(r >= top)
+        {
+            memcpy(a + first*cn, b + first*cn, (ts-first)*cn);
+            continue;
+        }
+        for(int c=first; c<ts; c++)
+        {
+            if(r >= hcut[c])
+            {
+                for(int k=0; k<cn; k++)
+                {
+                    a[c*cn+k] = b[c*cn+k];
+                }
+            }
+        }
+    }
+}
+
+typedef void (*BruteKernel)(const cv::Mat &, const cv::Mat &, int, cv::Mat &);
+typedef void (*SquareSumKernel)(const cv::Mat &, cv::Mat &);
+typedef void (*PasteKernel)(const cv::Mat &, const std::vector<int> &, const std::vector<int> &, cv::Mat &);
+
+// the overlap widths of the form's defaults and the usual powers of two
+template<int CN>
+BruteKernel select_brute_overlap(int ov)
+{
+    switch(ov)
+    {
+        case 13: return brute_distances<CN,13>;
+        case 16: return brute_distances<CN,16>;
+        case 32: return brute_distances<CN,32>;
+        default: return brute_distances<CN,0>;
+    }
+}
+
+inline BruteKernel select_brute_kernel(int cn, int ov)
+{
+    switch(cn)
+    {
+        case 1: return select_brute_overlap<1>(ov);
+        case 3: return select_brute_overlap<3>(ov);
+        case 4: return select_brute_overlap<4>(ov);
+        default: return brute_distances<0,0>;
+    }
+}
+
+inline SquareSumKernel select_square_sum(int cn)
+{
+    switch(cn)
+    {
+        case 1: return square_sum<1>;
+        case 3: return square_sum<3>;
+        case 4: return square_sum<4>;
+        default: return square_sum<0>;
+    }
+}
+
+inline PasteKernel select_paste(int cn)
+{
+    switch(cn)
+    {
+        case 1: return paste_cuts<1>;
+        case 3: return paste_cuts<3>;
+        case 4: return paste_cuts<4>;
+        default: return paste_cuts<0>;
+    }
+}
+
+#endif // KERNELS_H
@@ -0,0 +1,9 @@
+# OpenCV and boost locations shared by all targets
+
+INCLUDEPATH += /home/kevin/research/texture/image_quilting/ext
+
+INCLUDEPATH += /usr/local/opencv-2-4-10/include
+LIBS += -L/usr/local/opencv-2-4-10/lib -lopencv_core -lopencv_highgui -lopencv_imgproc
+
+# zlib for the streaming png encoder
+LIBS += -lz
@@ -0,0 +1,243 @@
+#include <placementlog.h>
+#include <cstdlib>
+#include <iterator>
+
+// quadrants of a split tile are never nested deeper than this in a valid log
+static const int MAX_DEPTH = 16;
+// a tile without cuts and quadrants: u16 exemplar, u32 sub1 and sub2, u8 transform and flags,
+// u16 vcut and hcut counts
+static const size_t MIN_TILE_BYTES = 16;
+
+static void put_u8(std::string &_out, unsigned int _v)
+{
+    _out.push_back((char)(_v & 0xff));
+}
+
+static void put_u16(std::string &_out, unsigned int _v)
+{
+    put_u8(_out, _v);
+    put_u8(_out, _v >> 8);
+}
+
+static void put_u32(std::string &_out, unsigned int _v)
+{
+    put_u16(_out, _v & 0xffff);
+    put_u16(_out, _v >> 16);
+}
+
+static bool get_u8(const std::string &_in, size_t &_pos, unsigned int &_v)
+{
+    if(_pos + 1 > _in.size())
+        return false;
+    _v = (unsigned char)_in[_pos++];
+    return true;
+}
+
+static bool get_u16(const std::string &_in, size_t &_pos, unsigned int &_v)
+{
+    unsigned int lo, hi;
+    if(!get_u8(_in, _pos, lo) || !get_u8(_in, _pos, hi))
+        return false;
+    _v = lo | (hi << 8);
+    return true;
+}
+
+static bool get_u32(const std::string &_in, size_t &_pos, unsigned int &_v)
+{
+    unsigned int lo, hi;
+    if(!get_u16(_in, _pos, lo) || !get_u16(_in, _pos, hi))
+        return false;
+    _v = lo | (hi << 16);
+    return true;
+}
+
+void PlacementLog::put_cut(std::string &_out, const std::vector<int> &_cut, bool _raw)
+{
+    put_u16(_out, _cut.size());
+    for(size_t k=0; k<_cut.size(); k++)
+    {
+        if(_raw || (k == 0))
+        {
+            put_u16(_out, _cut[k]);
+        }
+        else
+        {
+            put_u8(_out, (unsigned char)(signed char)(_cut[k] - _cut[k-1]));
+        }
+    }
+}
+
+bool PlacementLog::get_cut(const std::string &_in, size_t &_pos, std::vector<int> &_cut, bool _raw)
+{
+    unsigned int n, v;
+    if(!get_u16(_in, _pos, n))
+        return false;
+
+    _cut.resize(n);
+    for(size_t k=0; k<n; k++)
+    {
+        if(_raw || (k == 0))
+        {
+            if(!get_u16(_in, _pos, v))
+                return false;
+            _cut[k] = v;
+        }
+        else
+        {
+            if(!get_u8(_in, _pos, v))
+                return false;
+            _cut[k] = _cut[k-1] + (signed char)v;
+        }
+    }
+    return true;
+}
+
+void PlacementLog::put_tile(std::string &_out, const TilePlacement &_tile)
+{
+    // the deltas of a mincut are -1, 0 or +1, anything else is stored as is
+    bool raw = false;
+    const std::vector<int> *cuts[2] = { &_tile.vcut, &_tile.hcut };
+    for(int c=0; c<2; c++)
+    {
+        for(size_t k=1; k<cuts[c]->size(); k++)
+        {
+            raw = raw || (std::abs((*cuts[c])[k] - (*cuts[c])[k-1]) > 127);
+        }
+    }
+
+    put_u16(_out, _tile.exemplar);
+    put_u32(_out, _tile.sub1);
+    put_u32(_out, _tile.sub2);
+    put_u8(_out, _tile.transform);
+    put_u8(_out, (_tile.children.empty() ? 0 : FLAG_SPLIT) | (raw ? FLAG_RAW_CUTS : 0));
+    put_cut(_out, _tile.vcut, raw);
+    put_cut(_out, _tile.hcut, raw);
+    for(size_t q=0; q<_tile.children.size(); q++)
+    {
+        put_tile(_out, _tile.children[q]);
+    }
+}
+
+bool PlacementLog::get_tile(const std::string &_in, size_t &_pos, TilePlacement &_tile, int _depth)
+{
+    unsigned int exemplar, sub1, sub2, transform, flags;
+    if( !get_u16(_in, _pos, exemplar) ||
+        !get_u32(_in, _pos, sub1) || !get_u32(_in, _pos, sub2) ||
+        !get_u8(_in, _pos, transform) || !get_u8(_in, _pos, flags) )
+        return false;
+
+    _tile.exemplar = exemplar;
+    _tile.sub1 = sub1;
+    _tile.sub2 = sub2;
+    _tile.transform = transform;
+    if( !get_cut(_in, _pos, _tile.vcut, flags & FLAG_RAW_CUTS) ||
+        !get_cut(_in, _pos, _tile.hcut, flags & FLAG_RAW_CUTS) )
+        return false;
+
+    _tile.children.clear();
+    if(flags & FLAG_SPLIT)
+    {
+        if(_depth >= MAX_DEPTH)
+            return false;
+        _tile.children.resize(4);
+        for(int q=0; q<4; q++)
+        {
+            if(!get_tile(_in, _pos, _tile.children[q], _depth+1))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool PlacementLog::write(const std::string &_filename, const QuiltPlacement &_placement,
+                         const std::vector<cv::Mat> &_sources)
+{
+    std::string out;
+    encode(out, _placement, _sources);
+
+    std::ofstream file(_filename.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(out.data(), out.size());
+    if(!file)
+    {
+        std::cerr << "PlacementLog::write() - cannot write " << _filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool PlacementLog::read(const std::string &_filename, QuiltPlacement &_placement,
+                        std::vector<cv::Size> &_sizes, int &_channels)
+{
+    std::ifstream file(_filename.c_str(), std::ios::binary);
+    if(!file)
+    {
+        std::cerr << "PlacementLog::read() - cannot open " << _filename << std::endl;
+        return false;
+    }
+    std::string in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if(!decode(in, _placement, _sizes, _channels))
+    {
+        std::cerr << "PlacementLog::read() - " << _filename << " is not a valid placement log" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void PlacementLog::encode(std::string &_out, const QuiltPlacement &_placement, const std::vector<cv::Mat> &_sources)
+{
+    _out.append("QPLG");
+    put_u32(_out, VERSION);
+    put_u32(_out, _sources.size());
+    put_u32(_out, _sources.empty() ? 0 : _sources[0].channels());
+    for(size_t e=0; e<_sources.size(); e++)
+    {
+        put_u32(_out, _sources[e].rows);
+        put_u32(_out, _sources[e].cols);
+    }
+    put_u32(_out, _placement.tilesize);
+    put_u32(_out, _placement.overlap);
+    put_u32(_out, _placement.num_tiles);
+    for(size_t k=0; k<_placement.tiles.size(); k++)
+    {
+        put_tile(_out, _placement.tiles[k]);
+    }
+}
+
+bool PlacementLog::decode(const std::string &_in, QuiltPlacement &_placement,
+                          std::vector<cv::Size> &_sizes, int &_channels)
+{
+    size_t pos = 4;
+    unsigned int version, count, rows, cols, channels, tilesize, overlap, num_tiles;
+    bool ok = (_in.compare(0, 4, "QPLG") == 0) && get_u32(_in, pos, version) && (version == VERSION) &&
+              get_u32(_in, pos, count) && get_u32(_in, pos, channels) && (count > 0) && (count < 65536);
+
+    std::vector<cv::Size> sizes;
+    for(unsigned int e=0; ok && (e<count); e++)
+    {
+        ok = get_u32(_in, pos, rows) && get_u32(_in, pos, cols);
+        sizes.push_back(cv::Size(cols, rows));
+    }
+
+    // a truncated or corrupt log must not allocate more tiles than it can hold
+    ok = ok && get_u32(_in, pos, tilesize) && get_u32(_in, pos, overlap) && get_u32(_in, pos, num_tiles) &&
+         (num_tiles > 0) && (num_tiles < 65536) &&
+         ((size_t)num_tiles*num_tiles <= (_in.size() - pos)/MIN_TILE_BYTES);
+
+    if(ok)
+    {
+        _placement.tilesize = tilesize;
+        _placement.overlap = overlap;
+        _placement.num_tiles = num_tiles;
+        _placement.tiles.assign(num_tiles*num_tiles, TilePlacement());
+        for(size_t k=0; ok && (k<_placement.tiles.size()); k++)
+        {
+            ok = get_tile(_in, pos, _placement.tiles[k], 0);
+        }
+    }
+    if(!ok)
+        return false;
+
+    _sizes = sizes;
+    _channels = channels;
+    return true;
+}
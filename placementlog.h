@@ -0,0 +1,53 @@
+/*
+ * Placement log
+ *
+ * Compact binary record of a synthesis: the grid, the exemplar, source tile
+ * and transform of every tile and its seam cuts. Together with the sources it
+ * determines the output, ImageQuilting::render() rebuilds it without any
+ * search. Cuts move by at most one pixel per row, so they are stored as a
+ * start value and one signed byte per step.
+ *
+ * Layout, little endian:
+ *   "QPLG" u32 version
+ *   u32 exemplars, u32 channels, per exemplar u32 rows and u32 cols
+ *   u32 tilesize, u32 overlap, u32 num_tiles
+ *   num_tiles^2 tiles in raster order, each
+ *     u16 exemplar, u32 sub1, u32 sub2, u8 transform, u8 flags
+ *     vcut, hcut: u16 count, then u16 first value and i8 deltas
+ *                 (or u16 values when the RAW_CUTS flag is set)
+ *     four child tiles when the SPLIT flag is set
+ * Logs of any other version are rejected.
+ *
+ */
+
+#ifndef PLACEMENTLOG_H
+#define PLACEMENTLOG_H
+
+#include <string>
+#include <imagequilting.h>
+
+class PlacementLog
+{
+public:
+    static bool write(const std::string &_filename, const QuiltPlacement &_placement,
+                      const std::vector<cv::Mat> &_sources);
+    // _sizes and _channels return the sources the placement was made from
+    static bool read(const std::string &_filename, QuiltPlacement &_placement,
+                     std::vector<cv::Size> &_sizes, int &_channels);
+
+    // the same in memory, for files that embed a placement
+    static void encode(std::string &_out, const QuiltPlacement &_placement, const std::vector<cv::Mat> &_sources);
+    static bool decode(const std::string &_in, QuiltPlacement &_placement,
+                       std::vector<cv::Size> &_sizes, int &_channels);
+
+private:
+    enum { VERSION = 2 };
+    enum { FLAG_SPLIT = 1, FLAG_RAW_CUTS = 2 };
+
+    static void put_tile(std::string &_out, const TilePlacement &_tile);
+    static bool get_tile(const std::string &_in, size_t &_pos, TilePlacement &_tile, int _depth);
+    static void put_cut(std::string &_out, const std::vector<int> &_cut, bool _raw);
+    static bool get_cut(const std::string &_in, size_t &_pos, std::vector<int> &_cut, bool _raw);
+};
+
+#endif // PLACEMENTLOG_H
@@ -0,0 +1,245 @@
+/*
+ * Benchmark runner
+ *
+ * Runs a grid of parameter combinations over the given source images and
+ * fits the cost model to the measured wall time and peak memory.
+ *
+ * usage: quiltbench <parameters.xml> image...
+ *        quiltbench --kernels image...
+ *
+ * --kernels times the specialised kernels against the reference code
+ * instead, and checks that both produce the same output.
+ *
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <cmath>
+#include <thread>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <costmodel.h>
+
+// largest brute force run we are willing to wait for, in compared pixels
+static const double MAX_BRUTE_WORK = 2e9;
+
+static double now()
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+// run one synthesis in a child process, so its peak memory can be measured on its own
+static bool measure(const std::string &_filename, CostSample &_sample)
+{
+    int fds[2];
+    if(pipe(fds) != 0)
+        return false;
+
+    pid_t pid = fork();
+    if(pid < 0)
+        return false;
+
+    if(pid == 0)
+    {
+        close(fds[0]);
+        if(!freopen("/dev/null", "w", stdout))
+            _exit(1);
+        cv::setNumThreads(_sample.threads);
+
+        cv::Mat src = cv::imread(_filename, CV_LOAD_IMAGE_UNCHANGED);
+        cv::Mat res;
+        ImageQuilting imagequilting;
+
+        double start = now();
+        bool ok = imagequilting.synthesize(src, res, _sample.params);
+        double seconds = now() - start;
+
+        ssize_t written = write(fds[1], &seconds, sizeof(seconds));
+        _exit((ok && written == sizeof(seconds)) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    double seconds = 0;
+    bool ok = (read(fds[0], &seconds, sizeof(seconds)) == sizeof(seconds));
+    close(fds[0]);
+
+    int status;
+    rusage usage;
+    wait4(pid, &status, 0, &usage);
+    if(!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+
+    _sample.seconds = seconds;
+    _sample.bytes = usage.ru_maxrss*1024.0;   // ru_maxrss is in kilobytes on Linux
+    return true;
+}
+
+static double run_once(const cv::Mat &_src, QuiltParams _params, bool _kernels, cv::Mat &_res)
+{
+    ImageQuilting imagequilting;
+    _params.kernels = _kernels;
+
+    double start = now();
+    imagequilting.synthesize(_src, _res, _params);
+    return now() - start;
+}
+
+static int compare_kernels(int argc, char *argv[])
+{
+    // keep the per tile logging of the synthesis out of the report
+    std::streambuf *report = std::cout.rdbuf();
+    std::ofstream quiet("/dev/null");
+
+    for(int a=2; a<argc; a++)
+    {
+        cv::Mat src = cv::imread(argv[a], CV_LOAD_IMAGE_UNCHANGED);
+        if(src.empty())
+        {
+            std::cerr << "cannot read " << argv[a] << std::endl;
+            continue;
+        }
+        int min_size = std::min(src.rows, src.cols);
+
+        for(int mode=0; mode<2; mode++)
+        {
+            QuiltParams params;
+            params.tilesize = std::max(16, (int)(min_size*0.35));
+            params.overlap = std::min(13, params.tilesize/3);
+            params.num_tiles = 5;
+            params.useconv = (mode == 0);
+            params.seed = 1;
+
+            if(!params.useconv)
+            {
+                // the reference brute force search is slow, keep its runs short
+                params.num_tiles = 3;
+                double work = (double)(src.rows-params.tilesize)*(src.cols-params.tilesize)*
+                              params.tilesize*params.tilesize*params.num_tiles*params.num_tiles;
+                if(work > MAX_BRUTE_WORK/10)
+                    continue;
+            }
+
+            cv::Mat reference, specialised;
+            std::cout.rdbuf(quiet.rdbuf());
+            double t_reference = run_once(src, params, false, reference);
+            double t_specialised = run_once(src, params, true, specialised);
+            std::cout.rdbuf(report);
+
+            bool same = (reference.size() == specialised.size()) &&
+                        (cv::norm(reference, specialised, cv::NORM_INF) == 0);
+            std::cout << argv[a] << (params.useconv ? " conv " : " brute ")
+                      << "tilesize=" << params.tilesize << " overlap=" << params.overlap
+                      << " : reference " << t_reference << " s, kernels " << t_specialised << " s, speedup "
+                      << t_reference/t_specialised << "x, output " << (same ? "identical" : "differs") << std::endl;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 3)
+    {
+        std::cerr << "usage: quiltbench <parameters.xml> image..." << std::endl;
+        std::cerr << "       quiltbench --kernels image..." << std::endl;
+        return 1;
+    }
+    if(std::string(argv[1]) == "--kernels")
+    {
+        return compare_kernels(argc, argv);
+    }
+    std::string config = argv[1];
+    int max_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    CostModel model;
+    model.load(config);
+
+    std::vector<CostSample> samples;
+    for(int a=2; a<argc; a++)
+    {
+        cv::Mat src = cv::imread(argv[a], CV_LOAD_IMAGE_UNCHANGED);
+        if(src.empty())
+        {
+            std::cerr << "cannot read " << argv[a] << std::endl;
+            continue;
+        }
+        int min_size = std::min(src.rows, src.cols);
+
+        const double tile_ratios[] = { 0.2, 0.35, 0.5 };
+        const double overlap_ratios[] = { 1.0/6, 1.0/3 };
+        const int tiles[] = { 3, 5 };
+
+        for(int t=0; t<3; t++)
+        for(int o=0; o<2; o++)
+        for(int n=0; n<2; n++)
+        for(int mode=0; mode<3; mode++)
+        for(int c=0; c<2; c++)
+        {
+            CostSample sample;
+            sample.rows = src.rows;
+            sample.cols = src.cols;
+            sample.channels = src.channels();
+            sample.params.tilesize = std::max(3, (int)(min_size*tile_ratios[t]));
+            sample.params.overlap = std::max(1, (int)(sample.params.tilesize*overlap_ratios[o]));
+            sample.params.num_tiles = tiles[n];
+            sample.params.useconv = (mode != 2);
+            // without the mincut runs its term is not identified, and the downgrade relies on it
+            sample.params.complex = (c == 0);
+            sample.params.seed = 1;
+            // mode 1 repeats the convolution run on all cores for the parallel fraction
+            sample.threads = (mode == 1) ? max_threads : 1;
+
+            if( (mode == 1) && (max_threads == 1) )
+                continue;
+            if(!sample.params.useconv)
+            {
+                double work = (double)(src.rows-sample.params.tilesize)*(src.cols-sample.params.tilesize)*
+                              sample.params.tilesize*sample.params.tilesize*
+                              sample.params.num_tiles*sample.params.num_tiles;
+                if(work > MAX_BRUTE_WORK)
+                    continue;
+            }
+
+            if(!measure(argv[a], sample))
+            {
+                std::cerr << "run failed on " << argv[a] << std::endl;
+                continue;
+            }
+            samples.push_back(sample);
+
+            std::cout << argv[a] << " tilesize=" << sample.params.tilesize << " overlap=" << sample.params.overlap
+                      << " num_tiles=" << sample.params.num_tiles << " useconv=" << sample.params.useconv
+                      << " complex=" << sample.params.complex
+                      << " threads=" << sample.threads << " : " << sample.seconds << " s, "
+                      << sample.bytes/1e6 << " MB" << std::endl;
+        }
+    }
+
+    if(samples.empty())
+    {
+        std::cerr << "no successful runs" << std::endl;
+        return 1;
+    }
+
+    model.calibrate(samples);
+
+    // report how well the fitted model explains the runs
+    double time_err = 0, memory_err = 0;
+    for(size_t s=0; s<samples.size(); s++)
+    {
+        CostEstimate e = model.estimate(samples[s].rows, samples[s].cols, samples[s].channels, samples[s].params, samples[s].threads);
+        time_err += std::fabs(e.seconds - samples[s].seconds)/samples[s].seconds;
+        memory_err += std::fabs(e.bytes - samples[s].bytes)/samples[s].bytes;
+    }
+    std::cout << "mean relative error: time " << 100*time_err/samples.size() << "%, memory "
+              << 100*memory_err/samples.size() << "%" << std::endl;
+
+    if(!model.save(config))
+        return 1;
+    std::cout << "calibration written to " << config << std::endl;
+    return 0;
+}
@@ -0,0 +1,18 @@
+#-------------------------------------------------
+#
+# Benchmarks, fits the cost model in parameters.xml
+#
+#-------------------------------------------------
+
+QT       -= core gui
+CONFIG   -= qt
+
+TARGET = quiltbench
+TEMPLATE = app
+CONFIG += console thread
+
+include(quiltcore.pri)
+
+SOURCES += quiltbench.cpp
+
+CONFIG += c++11
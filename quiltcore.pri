@@ -0,0 +1,7 @@
+# link a target against the quiltcore library built by quiltcore.pro
+
+INCLUDEPATH += $$PWD
+LIBS += -L$$OUT_PWD -lquiltcore
+PRE_TARGETDEPS += $$OUT_PWD/libquiltcore.a
+
+include(opencv.pri)
@@ -0,0 +1,29 @@
+#-------------------------------------------------
+#
+# Qt-free image quilting library
+#
+#-------------------------------------------------
+
+QT       -= core gui
+CONFIG   -= qt
+
+TARGET = quiltcore
+TEMPLATE = lib
+CONFIG += staticlib
+
+include(opencv.pri)
+
+SOURCES += imagequilting.cpp \
+    costmodel.cpp \
+    placementlog.cpp \
+    checkpoint.cpp \
+    rowencoder.cpp
+
+HEADERS  += imagequilting.h \
+    costmodel.h \
+    kernels.h \
+    placementlog.h \
+    checkpoint.h \
+    rowencoder.h
+
+CONFIG += c++11
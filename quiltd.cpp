@@ -0,0 +1,56 @@
+/*
+ * Synthesis daemon entry point
+ *
+ * usage: quiltd [socket path] [workers] [queue size] [cache MB] [parameters.xml] [output dir]
+ *
+ * placement_log= and checkpoint= are only accepted with an output directory,
+ * their files are written there.
+ *
+ */
+
+#include <csignal>
+#include <thread>
+#include <quiltserver.h>
+
+static QuiltServer *server = NULL;
+
+static void on_signal(int)
+{
+    // only async-signal-safe work here, serve() returns once accept() fails
+    if(server)
+    {
+        server->interrupt();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string socket_path = (argc > 1) ? argv[1] : "/tmp/quiltd.sock";
+    int workers = (argc > 2) ? atoi(argv[2]) : (int)std::thread::hardware_concurrency();
+    size_t queue_size = (argc > 3) ? strtoul(argv[3], NULL, 10) : 64;
+    size_t cache_mb = (argc > 4) ? strtoul(argv[4], NULL, 10) : 256;
+    std::string config = (argc > 5) ? argv[5] : "parameters.xml";
+    std::string output_dir = (argc > 6) ? argv[6] : "";
+
+    if(workers < 1)
+        workers = 1;
+
+    // cost model and limits for the admission control
+    CostModel model;
+    model.load(config);
+
+    QuiltServer quiltserver(socket_path, workers, queue_size, cache_mb*1024*1024, model, output_dir);
+    if(!quiltserver.start())
+        return 1;
+
+    server = &quiltserver;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    quiltserver.serve();
+    quiltserver.stop();
+    server = NULL;
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+#-------------------------------------------------
+#
+# Synthesis daemon serving jobs over a Unix-domain socket
+#
+#-------------------------------------------------
+
+QT       -= core gui
+CONFIG   -= qt
+
+TARGET = quiltd
+TEMPLATE = app
+CONFIG += console thread
+
+include(quiltcore.pri)
+
+SOURCES += quiltd.cpp \
+    quiltserver.cpp
+
+HEADERS  += quiltserver.h
+
+CONFIG += c++11
@@ -0,0 +1,536 @@
+/*
+ * Python bindings
+ *
+ * The quilt extension module runs quiltcore on any object exposing 8-bit
+ * pixels through the buffer protocol (NumPy arrays, memoryviews, ...). The
+ * source is read in place and the result is written straight into the
+ * output array, no pixel data is copied. The GIL is released while the
+ * synthesis runs, so several threads can synthesize at once.
+ *
+ *   import quilt
+ *   out = quilt.synthesize(src, tilesize=80, num_tiles=5, overlap=13,
+ *                          seed=1, progress=lambda done, total: True)
+ *
+ * src has the shape (height, width) or (height, width, channels) with 1, 3
+ * or 4 channels in BGR(A) order; a list of such arrays of the same type and
+ * any size is searched as one pool of exemplars. Without out= a NumPy array is allocated,
+ * NumPy itself is only imported at run time for that.
+ *
+ *   quilt.synthesize(src, seed=1, placement_log='wall.qplg')
+ *   out = quilt.render(src, 'wall.qplg')
+ *
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <imagequilting.h>
+#include <placementlog.h>
+#include <rowencoder.h>
+#include <functional>
+
+// the engine throws cv::Exception on bad input and std::bad_alloc when memory runs out, neither
+// may unwind through the interpreter; runs _body without the GIL, which _save holds meanwhile, and
+// keeps the exception to raise once the GIL is back
+struct EngineError
+{
+    PyObject *type;
+    std::string message;
+
+    EngineError() : type(NULL) {}
+    bool raise() const
+    {
+        if(type == NULL)
+            return false;
+        PyErr_SetString(type, message.c_str());
+        return true;
+    }
+};
+
+static bool run_engine(PyThreadState *&_save, const std::function<bool()> &_body, EngineError &_error)
+{
+    bool ok = false;
+    _save = PyEval_SaveThread();
+    try
+    {
+        ok = _body();
+    }
+    catch(const std::bad_alloc &)
+    {
+        _error.type = PyExc_MemoryError;
+        _error.message = "out of memory";
+    }
+    catch(const std::exception &e)
+    {
+        _error.type = PyExc_RuntimeError;
+        _error.message = e.what();
+    }
+    PyEval_RestoreThread(_save);
+    return ok;
+}
+
+// a 2d or 3d uint8 buffer whose pixels are packed within each row
+static bool get_image(PyObject *_obj, Py_buffer &_view, int _flags, QuiltBuffer &_buffer, const char *_name)
+{
+    if(PyObject_GetBuffer(_obj, &_view, _flags | PyBUF_STRIDES | PyBUF_FORMAT) != 0)
+        return false;
+
+    bool bytes = (_view.itemsize == 1) && ((_view.format == NULL) || !strcmp(_view.format, "B"));
+    int channels = (_view.ndim == 3) ? (int)_view.shape[2] : 1;
+    bool packed = (_view.ndim >= 2) && (_view.strides[1] == channels) &&
+                  ((_view.ndim == 2) || (_view.strides[2] == 1)) && (_view.strides[0] > 0);
+    if( !bytes || ((_view.ndim != 2) && (_view.ndim != 3)) )
+    {
+        PyErr_Format(PyExc_TypeError, "%s must be a 2d or 3d array of uint8", _name);
+        PyBuffer_Release(&_view);
+        return false;
+    }
+    if(!packed)
+    {
+        PyErr_Format(PyExc_ValueError, "%s must be contiguous within its rows, see numpy.ascontiguousarray", _name);
+        PyBuffer_Release(&_view);
+        return false;
+    }
+
+    _buffer.data = (unsigned char *)_view.buf;
+    _buffer.height = (int)_view.shape[0];
+    _buffer.width = (int)_view.shape[1];
+    _buffer.channels = channels;
+    _buffer.step = (size_t)_view.strides[0];
+    return true;
+}
+
+// the views of one source array, or of a list or tuple of them for several exemplars
+struct SourceViews
+{
+    std::vector<Py_buffer> views;
+    std::vector<QuiltBuffer> buffers;
+
+    ~SourceViews()
+    {
+        for(size_t e=0; e<views.size(); e++)
+        {
+            PyBuffer_Release(&views[e]);
+        }
+    }
+};
+
+static bool get_sources(PyObject *_obj, SourceViews &_sources)
+{
+    bool many = PyList_Check(_obj) || PyTuple_Check(_obj);
+    Py_ssize_t count = many ? PySequence_Size(_obj) : 1;
+    if(count < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "source must not be empty");
+        return false;
+    }
+
+    _sources.views.reserve(count);
+    for(Py_ssize_t e=0; e<count; e++)
+    {
+        Py_buffer view;
+        QuiltBuffer buffer;
+        if(!get_image(many ? PySequence_Fast_GET_ITEM(_obj, e) : _obj, view, PyBUF_SIMPLE, buffer, "source"))
+            return false;
+        _sources.views.push_back(view);
+        _sources.buffers.push_back(buffer);
+    }
+    return true;
+}
+
+// numpy.empty(shape, dtype=numpy.uint8)
+static PyObject *new_array(int _rows, int _cols, int _channels)
+{
+    PyObject *numpy = PyImport_ImportModule("numpy");
+    if(numpy == NULL)
+        return NULL;
+
+    PyObject *shape = (_channels == 1) ? Py_BuildValue("(ii)", _rows, _cols)
+                                       : Py_BuildValue("(iii)", _rows, _cols, _channels);
+    PyObject *dtype = PyObject_GetAttrString(numpy, "uint8");
+    PyObject *array = NULL;
+    if( (shape != NULL) && (dtype != NULL) )
+    {
+        array = PyObject_CallMethod(numpy, "empty", "OO", shape, dtype);
+    }
+    Py_XDECREF(dtype);
+    Py_XDECREF(shape);
+    Py_DECREF(numpy);
+    return array;
+}
+
+static PyObject *quilt_synthesize(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = { "source", "tilesize", "num_tiles", "overlap", "useconv", "complex",
+                                      "err", "seed", "transforms", "adaptive", "split_threshold", "min_tilesize",
+                                      "coherence", "coherence_threshold", "placement_log", "checkpoint", "save",
+                                      "level", "progress", "out", NULL };
+    QuiltParams params;
+    PyObject *source = NULL, *progress = Py_None, *out = Py_None;
+    const char *placement_log = NULL, *checkpoint = NULL, *save_path = NULL;
+    int level = 6;
+    int useconv = params.useconv, complex = params.complex, transforms = params.transforms, adaptive = params.adaptive;
+    int coherence = params.coherence;
+    unsigned long seed = params.seed;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiippdkppdipdzzziOO", const_cast<char **>(keywords),
+                                    &source, &params.tilesize, &params.num_tiles, &params.overlap,
+                                    &useconv, &complex, &params.err, &seed, &transforms,
+                                    &adaptive, &params.split_threshold, &params.min_tilesize,
+                                    &coherence, &params.coherence_threshold, &placement_log, &checkpoint,
+                                    &save_path, &level, &progress, &out))
+        return NULL;
+    if(placement_log != NULL)
+    {
+        params.placement_log = placement_log;
+    }
+    if(checkpoint != NULL)
+    {
+        params.checkpoint = checkpoint;
+    }
+    params.useconv = useconv;
+    params.complex = complex;
+    params.transforms = transforms;
+    params.adaptive = adaptive;
+    params.coherence = coherence;
+    params.seed = (unsigned int)seed;
+
+    if( (progress != Py_None) && !PyCallable_Check(progress) )
+    {
+        PyErr_SetString(PyExc_TypeError, "progress must be callable");
+        return NULL;
+    }
+
+    SourceViews sources;
+    Py_buffer out_view;
+    QuiltBuffer imgout;
+    if(!get_sources(source, sources))
+        return NULL;
+
+    int destsize = ImageQuilting::output_size(params);
+    if(out == Py_None)
+    {
+        out = new_array(destsize, destsize, sources.buffers[0].channels);
+        if(out == NULL)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        Py_INCREF(out);
+    }
+    if(!get_image(out, out_view, PyBUF_WRITABLE, imgout, "out"))
+    {
+        Py_DECREF(out);
+        return NULL;
+    }
+
+    // the progress callback runs on this thread, it takes the GIL back for the call
+    PyThreadState *save = NULL;
+    bool raised = false;
+    QuiltProgress report;
+    if(progress != Py_None)
+    {
+        report = [&](int _done, int _total) -> bool
+        {
+            PyEval_RestoreThread(save);
+            PyObject *ret = PyObject_CallFunction(progress, "ii", _done, _total);
+            bool go_on = (ret != NULL) && ((ret == Py_None) || PyObject_IsTrue(ret));
+            raised = (ret == NULL);
+            Py_XDECREF(ret);
+            save = PyEval_SaveThread();
+            return go_on;
+        };
+    }
+
+    // save= encodes the finished tile rows while the later ones are searched
+    std::ofstream file;
+    RowEncoder encoder;
+    cv::Mat res(imgout.height, imgout.width, CV_8UC(imgout.channels), imgout.data, imgout.step);
+    if(save_path != NULL)
+    {
+        file.open(save_path, std::ios::binary | std::ios::trunc);
+        if( !file || !encoder.open(file, RowEncoder::format_of(save_path), destsize, destsize, imgout.channels, level) )
+        {
+            PyErr_Format(PyExc_ValueError, "cannot save to %s, the formats are .png, .ppm/.pgm/.pam and .raw", save_path);
+            PyBuffer_Release(&out_view);
+            Py_DECREF(out);
+            return NULL;
+        }
+        report = encoder.follow(res, params, report);
+    }
+
+    ImageQuilting imagequilting;
+    EngineError error;
+    bool ok = run_engine(save, [&]() -> bool
+    {
+        bool done = imagequilting.synthesize(sources.buffers, imgout, params, report);
+        return ((save_path == NULL) || encoder.close()) && done;
+    }, error);
+
+    PyBuffer_Release(&out_view);
+    if(!ok)
+    {
+        if(!error.raise() && !raised)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "synthesis or saving failed or was cancelled, see stderr");
+        }
+        Py_DECREF(out);
+        return NULL;
+    }
+    return out;
+}
+
+static PyObject *quilt_fill(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = { "image", "mask", "tilesize", "overlap", "err", "seed", "transforms",
+                                      "margin", "progress", "out", NULL };
+    QuiltParams params;
+    PyObject *image = NULL, *mask = NULL, *progress = Py_None, *out = Py_None;
+    int transforms = params.transforms;
+    unsigned long seed = params.seed;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iidkpiOO", const_cast<char **>(keywords),
+                                    &image, &mask, &params.tilesize, &params.overlap, &params.err, &seed,
+                                    &transforms, &params.fill_margin, &progress, &out))
+        return NULL;
+    params.transforms = transforms;
+    params.seed = (unsigned int)seed;
+
+    if( (progress != Py_None) && !PyCallable_Check(progress) )
+    {
+        PyErr_SetString(PyExc_TypeError, "progress must be callable");
+        return NULL;
+    }
+
+    SourceViews sources;
+    Py_buffer mask_view, out_view;
+    QuiltBuffer imgmask, imgout;
+    if( PyList_Check(image) || PyTuple_Check(image) )
+    {
+        PyErr_SetString(PyExc_TypeError, "image must be a single array");
+        return NULL;
+    }
+    if(!get_sources(image, sources))
+        return NULL;
+    const QuiltBuffer &imgin = sources.buffers[0];
+    if(!get_image(mask, mask_view, PyBUF_SIMPLE, imgmask, "mask"))
+        return NULL;
+    if( (imgmask.channels != 1) || (imgmask.height != imgin.height) || (imgmask.width != imgin.width) )
+    {
+        PyErr_SetString(PyExc_ValueError, "mask must be a 2d array of the size of image");
+        PyBuffer_Release(&mask_view);
+        return NULL;
+    }
+
+    // out=image fills in place
+    if(out == Py_None)
+    {
+        out = new_array(imgin.height, imgin.width, imgin.channels);
+        if(out == NULL)
+        {
+            PyBuffer_Release(&mask_view);
+            return NULL;
+        }
+    }
+    else
+    {
+        Py_INCREF(out);
+    }
+    if(!get_image(out, out_view, PyBUF_WRITABLE, imgout, "out"))
+    {
+        Py_DECREF(out);
+        PyBuffer_Release(&mask_view);
+        return NULL;
+    }
+    if( (imgout.height != imgin.height) || (imgout.width != imgin.width) || (imgout.channels != imgin.channels) )
+    {
+        PyErr_SetString(PyExc_ValueError, "out must have the shape of image");
+        PyBuffer_Release(&out_view);
+        Py_DECREF(out);
+        PyBuffer_Release(&mask_view);
+        return NULL;
+    }
+
+    PyThreadState *save = NULL;
+    bool raised = false;
+    QuiltProgress report;
+    if(progress != Py_None)
+    {
+        report = [&](int _done, int _total) -> bool
+        {
+            PyEval_RestoreThread(save);
+            PyObject *ret = PyObject_CallFunction(progress, "ii", _done, _total);
+            bool go_on = (ret != NULL) && ((ret == Py_None) || PyObject_IsTrue(ret));
+            raised = (ret == NULL);
+            Py_XDECREF(ret);
+            save = PyEval_SaveThread();
+            return go_on;
+        };
+    }
+
+    cv::Mat in(imgin.height, imgin.width, CV_8UC(imgin.channels), imgin.data, imgin.step);
+    cv::Mat m(imgmask.height, imgmask.width, CV_8UC1, imgmask.data, imgmask.step);
+    cv::Mat res(imgout.height, imgout.width, CV_8UC(imgout.channels), imgout.data, imgout.step);
+    ImageQuilting imagequilting;
+    EngineError error;
+    bool ok = run_engine(save, [&]() -> bool
+    {
+        return imagequilting.fill(in, m, res, params, report);
+    }, error);
+
+    PyBuffer_Release(&out_view);
+    PyBuffer_Release(&mask_view);
+    if(!ok)
+    {
+        if(!error.raise() && !raised)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "filling failed or was cancelled, see stderr");
+        }
+        Py_DECREF(out);
+        return NULL;
+    }
+    return out;
+}
+
+static PyObject *quilt_render(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = { "source", "placement_log", "out", NULL };
+    PyObject *source = NULL, *out = Py_None;
+    const char *log = NULL;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "Os|O", const_cast<char **>(keywords), &source, &log, &out))
+        return NULL;
+
+    // the log gives the output size
+    QuiltPlacement placement;
+    std::vector<cv::Size> sizes;
+    int channels;
+    if(!PlacementLog::read(log, placement, sizes, channels))
+    {
+        PyErr_Format(PyExc_ValueError, "cannot read the placement log %s, see stderr", log);
+        return NULL;
+    }
+
+    SourceViews sources;
+    Py_buffer out_view;
+    QuiltBuffer imgout;
+    if(!get_sources(source, sources))
+        return NULL;
+
+    std::vector<cv::Mat> in;
+    for(size_t e=0; e<sources.buffers.size(); e++)
+    {
+        const QuiltBuffer &b = sources.buffers[e];
+        in.push_back(cv::Mat(b.height, b.width, CV_8UC(b.channels), b.data, b.step));
+    }
+    bool same = (in.size() == sizes.size());
+    for(size_t e=0; same && (e<in.size()); e++)
+    {
+        same = (in[e].size() == sizes[e]) && (in[e].channels() == channels);
+    }
+    if(!same)
+    {
+        PyErr_Format(PyExc_ValueError, "the placement log was made from %d other sources with %d channels", (int)sizes.size(), channels);
+        return NULL;
+    }
+
+    QuiltParams params;
+    params.tilesize = placement.tilesize;
+    params.overlap = placement.overlap;
+    params.num_tiles = placement.num_tiles;
+    int destsize = ImageQuilting::output_size(params);
+    if(out == Py_None)
+    {
+        out = new_array(destsize, destsize, channels);
+        if(out == NULL)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        Py_INCREF(out);
+    }
+    if(!get_image(out, out_view, PyBUF_WRITABLE, imgout, "out"))
+    {
+        Py_DECREF(out);
+        return NULL;
+    }
+
+    EngineError error;
+    bool ok = (imgout.height == destsize) && (imgout.width == destsize) && (imgout.channels == channels);
+    if(ok)
+    {
+        cv::Mat res(imgout.height, imgout.width, CV_8UC(imgout.channels), imgout.data, imgout.step);
+        ImageQuilting imagequilting;
+        PyThreadState *save = NULL;
+        ok = run_engine(save, [&]() -> bool
+        {
+            return imagequilting.render(in, placement, res);
+        }, error);
+    }
+
+    PyBuffer_Release(&out_view);
+    if(!ok)
+    {
+        if(error.raise())
+        {
+            Py_DECREF(out);
+            return NULL;
+        }
+        PyErr_Format(PyExc_ValueError, "rendering failed, out must be %d x %d x %d, see stderr", destsize, destsize, channels);
+        Py_DECREF(out);
+        return NULL;
+    }
+    return out;
+}
+
+static PyObject *quilt_output_size(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = { "tilesize", "num_tiles", "overlap", NULL };
+    QuiltParams params;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|iii", const_cast<char **>(keywords),
+                                    &params.tilesize, &params.num_tiles, &params.overlap))
+        return NULL;
+    return PyLong_FromLong(ImageQuilting::output_size(params));
+}
+
+static PyMethodDef quilt_methods[] =
+{
+    { "synthesize", (PyCFunction)(void (*)(void))quilt_synthesize, METH_VARARGS | METH_KEYWORDS,
+      "synthesize(source, tilesize=80, num_tiles=5, overlap=13, useconv=True, complex=True,\n"
+      "           err=0.002, seed=0, transforms=False, adaptive=False, split_threshold=200,\n"
+      "           min_tilesize=16, coherence=False, coherence_threshold=200,\n"
+      "           placement_log=None, checkpoint=None, save=None, level=6, progress=None,\n"
+      "           out=None)\n\n"
+      "Quilt a texture from source, an array or a list of exemplar arrays.\n"
+      "progress(done, total) is called after every tile, returning False cancels.\n"
+      "The result is written into out when given, the placement into the file\n"
+      "placement_log. save writes the result to a .png (compression level 0-9),\n"
+      ".ppm/.pgm/.pam or .raw file while it is synthesized. With checkpoint the\n"
+      "finished tile rows are saved to that file, an interrupted call resumes\n"
+      "from it and gives the same result." },
+    { "fill", (PyCFunction)(void (*)(void))quilt_fill, METH_VARARGS | METH_KEYWORDS,
+      "fill(image, mask, tilesize=80, overlap=13, err=0.002, seed=0, transforms=False,\n"
+      "     margin=160, progress=None, out=None)\n\n"
+      "Fill the pixels of image where mask is non-zero with tiles taken from the\n"
+      "undamaged image within margin pixels of the mask. out=image fills in place." },
+    { "render", (PyCFunction)(void (*)(void))quilt_render, METH_VARARGS | METH_KEYWORDS,
+      "render(source, placement_log, out=None)\n\n"
+      "Rebuild a result from its source and placement log without searching." },
+    { "output_size", (PyCFunction)(void (*)(void))quilt_output_size, METH_VARARGS | METH_KEYWORDS,
+      "output_size(tilesize=80, num_tiles=5, overlap=13)\n\n"
+      "Side length of the synthesized texture." },
+    { NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef quilt_module =
+{
+    PyModuleDef_HEAD_INIT, "quilt", "Image quilting texture synthesis", -1, quilt_methods,
+    NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit_quilt(void)
+{
+    return PyModule_Create(&quilt_module);
+}
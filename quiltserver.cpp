@@ -0,0 +1,653 @@
+#include <quiltserver.h>
+#include <rowencoder.h>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// read a '\n' terminated line, one byte at a time so the payload stays in the socket
+static bool read_line(int _fd, std::string &_line)
+{
+    _line.clear();
+    char c;
+    while(true)
+    {
+        ssize_t n = ::read(_fd, &c, 1);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        if(c == '\n')
+            return true;
+        if(c != '\r')
+            _line.push_back(c);
+    }
+}
+
+static bool read_all(int _fd, unsigned char *_data, size_t _len)
+{
+    while(_len > 0)
+    {
+        ssize_t n = ::read(_fd, _data, _len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        _data += n;
+        _len -= n;
+    }
+    return true;
+}
+
+static bool write_all(int _fd, const void *_data, size_t _len)
+{
+    const char *p = static_cast<const char*>(_data);
+    while(_len > 0)
+    {
+        ssize_t n = ::send(_fd, p, _len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p += n;
+        _len -= n;
+    }
+    return true;
+}
+
+static bool write_line(int _fd, const std::string &_line)
+{
+    std::string s = _line + "\n";
+    return write_all(_fd, s.data(), s.size());
+}
+
+/*
+ * SourceCache
+ */
+
+SourceCache::SourceCache(size_t _capacity)
+    : capacity(_capacity), used(0)
+{
+}
+
+bool SourceCache::get(const std::string &_key, cv::Mat &_image)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<std::string, Entries::iterator>::iterator it = index.find(_key);
+    if(it == index.end())
+        return false;
+
+    // move to the front, it is now the most recently used
+    entries.splice(entries.begin(), entries, it->second);
+    _image = it->second->second;
+    return true;
+}
+
+void SourceCache::put(const std::string &_key, const cv::Mat &_image)
+{
+    size_t bytes = _image.total()*_image.elemSize();
+    if(bytes > capacity)
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    if(index.count(_key))
+        return;
+
+    entries.push_front(std::make_pair(_key, _image));
+    index[_key] = entries.begin();
+    used += bytes;
+
+    // evict the least recently used sources
+    while(used > capacity)
+    {
+        cv::Mat &last = entries.back().second;
+        used -= last.total()*last.elemSize();
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
+
+/*
+ * JobQueue
+ */
+
+bool JobQueue::Order::operator()(const std::shared_ptr<QuiltJob> &_a, const std::shared_ptr<QuiltJob> &_b) const
+{
+    // priority_queue pops the largest, so a < b means b runs first
+    if(_a->priority != _b->priority)
+        return _a->priority < _b->priority;
+    return _a->sequence > _b->sequence;
+}
+
+JobQueue::JobQueue(size_t _capacity)
+    : capacity(_capacity), sequence(0), closed(false)
+{
+}
+
+bool JobQueue::push(const std::shared_ptr<QuiltJob> &_job, size_t &_ahead)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(closed || jobs.size() >= capacity)
+            return false;
+
+        _ahead = jobs.size();
+        _job->sequence = sequence++;
+        jobs.push(_job);
+    }
+    available.notify_one();
+    return true;
+}
+
+std::shared_ptr<QuiltJob> JobQueue::pop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while(!closed && jobs.empty())
+    {
+        available.wait(guard);
+    }
+    // after close() the remaining jobs are still handed out, so their clients get an answer
+    if(jobs.empty())
+        return std::shared_ptr<QuiltJob>();
+
+    std::shared_ptr<QuiltJob> job = jobs.top();
+    jobs.pop();
+    return job;
+}
+
+void JobQueue::close()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+    }
+    available.notify_all();
+}
+
+/*
+ * QuiltServer
+ */
+
+QuiltServer::QuiltServer(const std::string &_socket_path, int _workers, size_t _queue_size, size_t _cache_bytes,
+                         const CostModel &_model, const std::string &_output_dir)
+    : socket_path(_socket_path), num_workers(_workers), listen_fd(-1), running(false),
+      max_source_bytes(_cache_bytes), output_dir(_output_dir), queue(_queue_size), cache(_cache_bytes), model(_model),
+      max_connections(_queue_size + std::max(1, _workers)), next_handler(0)
+{
+}
+
+QuiltServer::~QuiltServer()
+{
+    stop();
+}
+
+bool QuiltServer::start()
+{
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0)
+    {
+        std::cerr << "QuiltServer::start() - socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "QuiltServer::start() - socket path too long" << std::endl;
+        return false;
+    }
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path)-1);
+    ::unlink(socket_path.c_str());
+
+    if( (::bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0) || (::listen(listen_fd, 64) < 0) )
+    {
+        std::cerr << "QuiltServer::start() - bind " << socket_path << ": " << strerror(errno) << std::endl;
+        ::close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    running = true;
+    for(int i=0; i<num_workers; i++)
+    {
+        workers.push_back(std::thread(&QuiltServer::worker, this));
+    }
+    std::cout << "listening on " << socket_path << " with " << num_workers << " workers" << std::endl;
+    return true;
+}
+
+void QuiltServer::serve()
+{
+    while(running)
+    {
+        int fd = ::accept(listen_fd, NULL, NULL);
+        if(fd < 0)
+        {
+            if(errno == EINTR && running)
+                continue;
+            break;
+        }
+        reap();
+
+        std::lock_guard<std::mutex> guard(connections_lock);
+        if(handlers.size() >= max_connections)
+        {
+            write_line(fd, "ERROR busy");
+            ::close(fd);
+            continue;
+        }
+        unsigned long id = next_handler++;
+        client_fds.insert(fd);
+        handlers[id] = std::thread(&QuiltServer::handle, this, fd, id);
+    }
+}
+
+void QuiltServer::reap()
+{
+    std::lock_guard<std::mutex> guard(connections_lock);
+    for(size_t k=0; k<finished_handlers.size(); k++)
+    {
+        std::map<unsigned long, std::thread>::iterator it = handlers.find(finished_handlers[k]);
+        if(it != handlers.end())
+        {
+            it->second.join();
+            handlers.erase(it);
+        }
+    }
+    finished_handlers.clear();
+}
+
+void QuiltServer::interrupt()
+{
+    ::shutdown(listen_fd, SHUT_RDWR);
+}
+
+void QuiltServer::stop()
+{
+    if(!running.exchange(false))
+        return;
+
+    ::shutdown(listen_fd, SHUT_RDWR);
+    ::close(listen_fd);
+    ::unlink(socket_path.c_str());
+
+    // the handlers' reads and progress writes fail from now on, which cancels their jobs
+    {
+        std::lock_guard<std::mutex> guard(connections_lock);
+        for(std::set<int>::iterator it = client_fds.begin(); it != client_fds.end(); ++it)
+        {
+            ::shutdown(*it, SHUT_RDWR);
+        }
+    }
+
+    queue.close();
+    for(size_t i=0; i<workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    workers.clear();
+
+    // every job is answered now, the handlers return; they take the lock on the way out
+    std::map<unsigned long, std::thread> remaining;
+    {
+        std::lock_guard<std::mutex> guard(connections_lock);
+        remaining.swap(handlers);
+        finished_handlers.clear();
+    }
+    for(std::map<unsigned long, std::thread>::iterator it = remaining.begin(); it != remaining.end(); ++it)
+    {
+        it->second.join();
+    }
+}
+
+void QuiltServer::worker()
+{
+    // every worker owns its engine, ImageQuilting keeps per-run state
+    ImageQuilting imagequilting;
+
+    std::shared_ptr<QuiltJob> job;
+    while( (job = queue.pop()) )
+    {
+        if(running)
+        {
+            // a bad source or an oversized job fails that job, not the daemon
+            try
+            {
+                execute(*job, imagequilting);
+            }
+            catch(const std::bad_alloc &)
+            {
+                job->result.release();
+                job->error = "out of memory";
+            }
+            catch(const std::exception &e)
+            {
+                job->result.release();
+                job->error = std::string("synthesis failed: ") + e.what();
+            }
+        }
+        else
+        {
+            job->error = "server shutting down";
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(job->lock);
+            job->done = true;
+        }
+        job->finished.notify_all();
+    }
+}
+
+void QuiltServer::execute(QuiltJob &_job, ImageQuilting &_imagequilting)
+{
+    // encode the finished tile rows while the later ones are searched
+    std::ostringstream encoded;
+    RowEncoder encoder;
+    int destsize = ImageQuilting::output_size(_job.params);
+    bool ok = encoder.open(encoded, _job.format, destsize, destsize, _job.source.channels(), _job.level) &&
+              _imagequilting.synthesize(_job.source, _job.result, _job.params,
+                                        encoder.follow(_job.result, _job.params, _job.progress));
+    ok = encoder.close() && ok;
+    if(!ok)
+    {
+        _job.result.release();
+        _job.error = "synthesis failed or cancelled";
+        return;
+    }
+    _job.encoded = encoded.str();
+}
+
+bool QuiltServer::load_source(QuiltJob &_job)
+{
+    cv::Mat &image = _job.source;
+    std::ostringstream key;
+    if(!_job.source_path.empty())
+    {
+        // key on the modification time as well, so edited files are reloaded
+        struct stat st;
+        if(::stat(_job.source_path.c_str(), &st) != 0)
+        {
+            _job.error = "cannot open " + _job.source_path;
+            return false;
+        }
+        key << "path:" << _job.source_path << ":" << st.st_mtime << ":" << st.st_size;
+    }
+    else
+    {
+        std::string bytes(_job.source_bytes.begin(), _job.source_bytes.end());
+        key << "bytes:" << std::hash<std::string>()(bytes) << ":" << bytes.size();
+    }
+
+    if(cache.get(key.str(), image))
+        return true;
+
+    if(!_job.source_path.empty())
+    {
+        image = cv::imread(_job.source_path, CV_LOAD_IMAGE_UNCHANGED);
+    }
+    else
+    {
+        image = cv::imdecode(cv::Mat(_job.source_bytes), CV_LOAD_IMAGE_UNCHANGED);
+    }
+    if(image.empty() || image.depth() != CV_8U)
+    {
+        _job.error = "cannot decode source image";
+        return false;
+    }
+
+    cache.put(key.str(), image);
+    return true;
+}
+
+bool QuiltServer::parse_request(const std::string &_line, QuiltJob &_job, size_t &_nbytes, std::string &_error)
+{
+    std::istringstream in(_line);
+    std::string command, token;
+    in >> command;
+    if(command != "SYNTH")
+    {
+        _error = "unknown command " + command;
+        return false;
+    }
+
+    _nbytes = 0;
+    while(in >> token)
+    {
+        size_t eq = token.find('=');
+        if(eq == std::string::npos)
+        {
+            _error = "malformed argument " + token;
+            return false;
+        }
+        std::string key = token.substr(0, eq);
+        std::string value = token.substr(eq+1);
+
+        if(key == "path")               _job.source_path = value;
+        else if(key == "bytes")         _nbytes = strtoul(value.c_str(), NULL, 10);
+        else if(key == "tilesize")      _job.params.tilesize = atoi(value.c_str());
+        else if(key == "overlap")       _job.params.overlap = atoi(value.c_str());
+        else if(key == "num_tiles")     _job.params.num_tiles = atoi(value.c_str());
+        else if(key == "useconv")       _job.params.useconv = atoi(value.c_str()) != 0;
+        else if(key == "complex")       _job.params.complex = atoi(value.c_str()) != 0;
+        else if(key == "transforms")    _job.params.transforms = atoi(value.c_str()) != 0;
+        else if(key == "adaptive")      _job.params.adaptive = atoi(value.c_str()) != 0;
+        else if(key == "split_threshold") _job.params.split_threshold = atof(value.c_str());
+        else if(key == "min_tilesize")  _job.params.min_tilesize = atoi(value.c_str());
+        else if(key == "coherence")     _job.params.coherence = atoi(value.c_str()) != 0;
+        else if(key == "coherence_threshold") _job.params.coherence_threshold = atof(value.c_str());
+        else if(key == "placement_log")
+        {
+            if(!output_path(key, value, _job.params.placement_log, _error))
+                return false;
+        }
+        else if(key == "checkpoint")
+        {
+            if(!output_path(key, value, _job.params.checkpoint, _error))
+                return false;
+        }
+        else if(key == "err")           _job.params.err = atof(value.c_str());
+        else if(key == "seed")          _job.params.seed = strtoul(value.c_str(), NULL, 10);
+        else if(key == "priority")      _job.priority = atoi(value.c_str());
+        else if(key == "format")        _job.format = value;
+        else if(key == "level")         _job.level = atoi(value.c_str());
+        else
+        {
+            _error = "unknown argument " + key;
+            return false;
+        }
+    }
+
+    if(_job.source_path.empty() == (_nbytes == 0))
+    {
+        _error = "exactly one of path and bytes is required";
+        return false;
+    }
+    if(_job.format != "png" && _job.format != "ppm" && _job.format != "raw")
+    {
+        _error = "unknown format " + _job.format;
+        return false;
+    }
+    return true;
+}
+
+// clients name the files the server writes and removes, keep them inside its output directory
+bool QuiltServer::output_path(const std::string &_key, const std::string &_name, std::string &_path, std::string &_error)
+{
+    if(output_dir.empty())
+    {
+        _error = _key + " needs an output directory, see the quiltd usage";
+        return false;
+    }
+    if( _name.empty() || (_name.find('/') != std::string::npos) || (_name.find("..") != std::string::npos) )
+    {
+        _error = "invalid " + _key + " " + _name + ", a file name without '/' or '..' is required";
+        return false;
+    }
+    _path = output_dir + "/" + _name;
+    return true;
+}
+
+// two jobs writing the same file in the output directory would race on its temporary and the rename
+bool QuiltServer::claim_outputs(const QuiltJob &_job, std::string &_error)
+{
+    std::string names[2] = { _job.params.placement_log, _job.params.checkpoint };
+    std::lock_guard<std::mutex> guard(connections_lock);
+    if( !names[0].empty() && (names[0] == names[1]) )
+    {
+        _error = "placement_log and checkpoint must be different files";
+        return false;
+    }
+    for(int k=0; k<2; k++)
+    {
+        if( !names[k].empty() && outputs.count(names[k]) )
+        {
+            _error = names[k] + " is in use by another job";
+            return false;
+        }
+    }
+    for(int k=0; k<2; k++)
+    {
+        if(!names[k].empty())
+            outputs.insert(names[k]);
+    }
+    return true;
+}
+
+void QuiltServer::release_outputs(const QuiltJob &_job)
+{
+    std::lock_guard<std::mutex> guard(connections_lock);
+    outputs.erase(_job.params.placement_log);
+    outputs.erase(_job.params.checkpoint);
+}
+
+void QuiltServer::handle(int _fd, unsigned long _id)
+{
+    std::string line;
+    while(running && read_line(_fd, line))
+    {
+        if(line.empty())
+            continue;
+
+        std::shared_ptr<QuiltJob> job = std::make_shared<QuiltJob>();
+        size_t nbytes;
+        std::string error;
+        if(!parse_request(line, *job, nbytes, error))
+        {
+            if(!write_line(_fd, "ERROR " + error))
+                break;
+            continue;
+        }
+        if(nbytes > max_source_bytes)
+        {
+            // the payload is still in the socket, the connection cannot be read any further
+            std::ostringstream msg;
+            msg << "ERROR source of " << nbytes << " bytes, at most " << max_source_bytes << " are accepted";
+            write_line(_fd, msg.str());
+            break;
+        }
+        if(nbytes > 0)
+        {
+            job->source_bytes.resize(nbytes);
+            if(!read_all(_fd, &job->source_bytes[0], nbytes))
+                break;
+        }
+
+        // decode here, the admission control needs the source size
+        if(!load_source(*job))
+        {
+            if(!write_line(_fd, "ERROR " + job->error))
+                break;
+            continue;
+        }
+        job->source_bytes.clear();
+
+        // the search runs on OpenCV's thread pool, which the workers share
+        CostEstimate estimate;
+        int threads = std::max(1, cv::getNumThreads()/num_workers);
+        AdmissionDecision decision = model.admit(job->source.rows, job->source.cols, job->source.channels(),
+                                                 job->params, threads, estimate);
+        std::ostringstream admitted;
+        admitted << "ESTIMATE " << estimate.seconds << " " << estimate.bytes;
+        write_line(_fd, admitted.str());
+        if(decision == ADMIT_REJECT)
+        {
+            if(!write_line(_fd, "ERROR rejected, over the configured limits"))
+                break;
+            continue;
+        }
+        if(decision == ADMIT_DOWNGRADE)
+        {
+            std::ostringstream downgraded;
+            downgraded << "DOWNGRADED useconv=" << job->params.useconv << " complex=" << job->params.complex;
+            write_line(_fd, downgraded.str());
+        }
+
+        // stream the progress back, a client that went away cancels its job; the worker
+        // writes to the connection too, so every line written meanwhile takes the lock
+        std::shared_ptr<std::mutex> writing = std::make_shared<std::mutex>();
+        job->progress = [_fd, writing](int _done, int _total)
+        {
+            std::ostringstream msg;
+            msg << "PROGRESS " << _done << " " << _total;
+            std::lock_guard<std::mutex> guard(*writing);
+            return write_line(_fd, msg.str());
+        };
+
+        if(!claim_outputs(*job, error))
+        {
+            if(!write_line(_fd, "ERROR " + error))
+                break;
+            continue;
+        }
+        {
+            // held from the push on, so QUEUED goes out before the first PROGRESS
+            std::lock_guard<std::mutex> guard(*writing);
+            size_t ahead;
+            if(!queue.push(job, ahead))
+            {
+                release_outputs(*job);
+                if(!write_line(_fd, "ERROR busy"))
+                    break;
+                continue;
+            }
+            std::ostringstream queued;
+            queued << "QUEUED " << ahead;
+            write_line(_fd, queued.str());
+        }
+
+        {
+            std::unique_lock<std::mutex> guard(job->lock);
+            while(!job->done)
+            {
+                job->finished.wait(guard);
+            }
+        }
+        release_outputs(*job);
+
+        if(job->result.empty())
+        {
+            if(!write_line(_fd, "ERROR " + job->error))
+                break;
+            continue;
+        }
+
+        const std::string &data = job->encoded;
+        cv::Mat &res = job->result;
+        std::ostringstream header;
+        header << "RESULT " << res.cols << " " << res.rows << " " << res.channels() << " "
+               << job->format << " " << data.size();
+        if(!write_line(_fd, header.str()) || !write_all(_fd, data.data(), data.size()))
+            break;
+    }
+
+    std::lock_guard<std::mutex> guard(connections_lock);
+    client_fds.erase(_fd);
+    ::close(_fd);
+    finished_handlers.push_back(_id);
+}
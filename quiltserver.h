@@ -0,0 +1,163 @@
+/*
+ * Synthesis daemon
+ *
+ * Serves synthesis jobs over a local Unix-domain socket. Jobs are queued
+ * by priority, run on a shared pool of workers, and decoded sources are
+ * kept in an LRU cache between jobs.
+ *
+ * Protocol, one request per line:
+ *   SYNTH key=value ...           [followed by <bytes> bytes of image data]
+ * keys: path, bytes, tilesize, overlap, num_tiles, useconv, complex, transforms,
+ *       adaptive, split_threshold, min_tilesize, coherence, coherence_threshold,
+ *       placement_log, checkpoint, err, seed, priority, format (png, ppm or raw),
+ *       level (png compression, 0-9).
+ *       Values must not contain spaces. bytes is at most the cache size.
+ *       placement_log and checkpoint are file names in the server's output
+ *       directory, without '/' or "..", and are refused when it has none or
+ *       when a queued or running job uses the same file.
+ * A connection beyond queue size + workers is answered ERROR busy and closed.
+ * replies:
+ *   ESTIMATE <seconds> <bytes>
+ *   DOWNGRADED useconv=<0|1> complex=<0|1>
+ *   QUEUED <jobs ahead>
+ *   PROGRESS <tiles done> <total tiles>
+ *   RESULT <width> <height> <channels> <format> <nbytes>   followed by the data
+ *   ERROR <message>
+ *
+ */
+
+#ifndef QUILTSERVER_H
+#define QUILTSERVER_H
+
+#include <string>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <imagequilting.h>
+#include <costmodel.h>
+
+// one synthesis request and its outcome
+struct QuiltJob
+{
+    std::string source_path;                  // a file on the server ...
+    std::vector<unsigned char> source_bytes;  // ... or an encoded image
+    QuiltParams params;
+    int priority;                             // higher runs first
+    unsigned long sequence;                   // FIFO order within a priority
+    std::string format;
+    int level;                                // png compression level
+
+    cv::Mat source;
+    QuiltProgress progress;
+    cv::Mat result;
+    std::string encoded;                      // the result in format, encoded while it is synthesized
+    std::string error;
+
+    bool done;
+    std::mutex lock;
+    std::condition_variable finished;
+
+    QuiltJob() : priority(0), sequence(0), format("png"), level(6), done(false) {}
+};
+
+// LRU cache of decoded sources, bounded by their pixel memory
+class SourceCache
+{
+public:
+    SourceCache(size_t _capacity);
+
+    bool get(const std::string &_key, cv::Mat &_image);
+    void put(const std::string &_key, const cv::Mat &_image);
+
+private:
+    typedef std::list< std::pair<std::string, cv::Mat> > Entries;
+
+    Entries entries;    // most recently used first
+    std::map<std::string, Entries::iterator> index;
+    size_t capacity;
+    size_t used;
+    std::mutex lock;
+};
+
+// bounded priority queue feeding the workers
+class JobQueue
+{
+public:
+    JobQueue(size_t _capacity);
+
+    // returns false when the queue is full or closed, the caller must back off
+    bool push(const std::shared_ptr<QuiltJob> &_job, size_t &_ahead);
+    // blocks until a job is available, returns null once closed and drained
+    std::shared_ptr<QuiltJob> pop();
+    void close();
+
+private:
+    struct Order
+    {
+        bool operator()(const std::shared_ptr<QuiltJob> &_a, const std::shared_ptr<QuiltJob> &_b) const;
+    };
+
+    std::priority_queue< std::shared_ptr<QuiltJob>, std::vector< std::shared_ptr<QuiltJob> >, Order > jobs;
+    size_t capacity;
+    unsigned long sequence;
+    bool closed;
+    std::mutex lock;
+    std::condition_variable available;
+};
+
+class QuiltServer
+{
+public:
+    QuiltServer(const std::string &_socket_path, int _workers, size_t _queue_size, size_t _cache_bytes,
+                const CostModel &_model, const std::string &_output_dir = "");
+    ~QuiltServer();
+
+    bool start();
+    // accept connections until interrupt() or stop() is called
+    void serve();
+    // wake serve() up, safe to call from a signal handler
+    void interrupt();
+    void stop();
+
+private:
+    void worker();
+    void handle(int _fd, unsigned long _id);
+    void reap();
+    bool claim_outputs(const QuiltJob &_job, std::string &_error);
+    void release_outputs(const QuiltJob &_job);
+    void execute(QuiltJob &_job, ImageQuilting &_imagequilting);
+    bool load_source(QuiltJob &_job);
+    bool parse_request(const std::string &_line, QuiltJob &_job, size_t &_nbytes, std::string &_error);
+    bool output_path(const std::string &_key, const std::string &_name, std::string &_path, std::string &_error);
+
+    std::string socket_path;
+    int num_workers;
+    int listen_fd;
+    std::atomic<bool> running;
+    size_t max_source_bytes;    // largest encoded source accepted with bytes=
+    std::string output_dir;     // where placement logs and checkpoints go, none when empty
+
+    JobQueue queue;
+    SourceCache cache;
+    CostModel model;
+    std::vector<std::thread> workers;
+
+    // connection handlers, at most one per job the workers and the queue can hold;
+    // finished ones are joined by serve(), the rest by stop()
+    size_t max_connections;
+    std::mutex connections_lock;
+    std::map<unsigned long, std::thread> handlers;
+    std::set<int> client_fds;
+    std::vector<unsigned long> finished_handlers;
+    unsigned long next_handler;
+    std::set<std::string> outputs;  // placement logs and checkpoints of queued and running jobs
+};
+
+#endif // QUILTSERVER_H
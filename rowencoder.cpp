@@ -0,0 +1,302 @@
+#include <rowencoder.h>
+#include <sstream>
+#include <cstring>
+#include <cctype>
+
+// size of one IDAT chunk
+static const size_t CHUNK = 1 << 16;
+
+static void put_be32(unsigned char *_p, unsigned int _v)
+{
+    _p[0] = (_v >> 24) & 0xff;
+    _p[1] = (_v >> 16) & 0xff;
+    _p[2] = (_v >> 8) & 0xff;
+    _p[3] = _v & 0xff;
+}
+
+RowEncoder::RowEncoder()
+    : out(NULL), rows(0), cols(0), channels(0), level(6), queued(0), written(0), failed(false), closing(false)
+{
+}
+
+RowEncoder::~RowEncoder()
+{
+    if(worker.joinable())
+    {
+        close();
+    }
+}
+
+std::string RowEncoder::format_of(const std::string &_filename)
+{
+    size_t dot = _filename.rfind('.');
+    std::string ext = (dot == std::string::npos) ? "" : _filename.substr(dot+1);
+    for(size_t k=0; k<ext.size(); k++)
+    {
+        ext[k] = tolower(ext[k]);
+    }
+
+    if(ext == "png")
+        return "png";
+    if( (ext == "ppm") || (ext == "pgm") || (ext == "pam") )
+        return "ppm";
+    if(ext == "raw")
+        return "raw";
+    return "";
+}
+
+bool RowEncoder::open(std::ostream &_out, const std::string &_format, int _rows, int _cols, int _channels, int _level)
+{
+    if(worker.joinable())
+    {
+        std::cerr << "RowEncoder::open() - already encoding" << std::endl;
+        return false;
+    }
+    // png and ppm store gray, RGB or RGBA, raw anything
+    bool image = (_format == "png") || (_format == "ppm");
+    if( ((_format != "raw") && !image) || (_rows < 1) || (_cols < 1) ||
+        (image && (_channels != 1) && (_channels != 3) && (_channels != 4)) )
+    {
+        std::cerr << "RowEncoder::open() - cannot write a " << _rows << " X " << _cols << " X "
+                  << _channels << " image as " << _format << std::endl;
+        return false;
+    }
+
+    out = &_out;
+    format = _format;
+    rows = _rows;
+    cols = _cols;
+    channels = _channels;
+    level = std::min(9, std::max(0, _level));
+    queued = 0;
+    written = 0;
+    failed = false;
+    closing = false;
+
+    if(format == "png")
+    {
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        if(deflateInit(&zs, level) != Z_OK)
+        {
+            std::cerr << "RowEncoder::open() - cannot initialize zlib" << std::endl;
+            return false;
+        }
+        compressed.resize(CHUNK);
+        zs.next_out = compressed.data();
+        zs.avail_out = compressed.size();
+    }
+
+    write_header();
+    worker = std::thread(&RowEncoder::work, this);
+    return true;
+}
+
+void RowEncoder::push(const cv::Mat &_rows)
+{
+    cv::Mat band = _rows.clone();
+    queued += band.rows;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        bands.push(band);
+    }
+    ready.notify_one();
+}
+
+QuiltProgress RowEncoder::follow(const cv::Mat &_image, const QuiltParams &_params, QuiltProgress _next)
+{
+    // the image is allocated by the synthesis, look at it only once rows are done
+    const cv::Mat *image = &_image;
+    int step = _params.tilesize - _params.overlap;
+    int n = _params.num_tiles;
+    return [this, image, step, n, _next](int _done, int _total) -> bool
+    {
+        // the tiles run in raster order, a finished tile row is final down to
+        // where the next tile row starts
+        if( (_done % n == 0) || (_done == _total) )
+        {
+            int done_rows = (_done == _total) ? image->rows : std::min(image->rows, (_done/n)*step);
+            if(done_rows > queued)
+            {
+                push(image->rowRange(queued, done_rows));
+            }
+        }
+        return _next ? _next(_done, _total) : true;
+    };
+}
+
+bool RowEncoder::close()
+{
+    if(!worker.joinable())
+        return false;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+    }
+    ready.notify_one();
+    worker.join();
+
+    if(written != rows)
+    {
+        std::cerr << "RowEncoder::close() - " << written << " of " << rows << " rows written" << std::endl;
+        return false;
+    }
+    if(failed || !out->good())
+    {
+        std::cerr << "RowEncoder::close() - writing the " << format << " output failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void RowEncoder::work()
+{
+    for(;;)
+    {
+        cv::Mat band;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while( bands.empty() && !closing )
+            {
+                ready.wait(guard);
+            }
+            if(bands.empty())
+                break;
+            band = bands.front();
+            bands.pop();
+        }
+        encode(band);
+    }
+
+    if(format == "png")
+    {
+        // a complete image ends the deflate stream, a short one is left without IEND
+        if(written == rows)
+        {
+            zs.next_in = NULL;
+            zs.avail_in = 0;
+            deflate_rows(Z_FINISH);
+            write_chunk("IEND", NULL, 0);
+        }
+        deflateEnd(&zs);
+    }
+    out->flush();
+}
+
+void RowEncoder::write_header()
+{
+    std::ostringstream header;
+    if(format == "ppm")
+    {
+        if(channels == 4)
+        {
+            header << "P7\nWIDTH " << cols << "\nHEIGHT " << rows << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+        }
+        else
+        {
+            header << ((channels == 1) ? "P5" : "P6") << "\n" << cols << " " << rows << "\n255\n";
+        }
+        out->write(header.str().data(), header.str().size());
+    }
+    else if(format == "png")
+    {
+        static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+        out->write((const char *)signature, 8);
+
+        // 8 bits, gray (0), RGB (2) or RGBA (6), no interlacing
+        unsigned char ihdr[13];
+        put_be32(ihdr, cols);
+        put_be32(ihdr+4, rows);
+        ihdr[8] = 8;
+        ihdr[9] = (channels == 1) ? 0 : ((channels == 3) ? 2 : 6);
+        ihdr[10] = 0;
+        ihdr[11] = 0;
+        ihdr[12] = 0;
+        write_chunk("IHDR", ihdr, 13);
+    }
+}
+
+void RowEncoder::write_chunk(const char *_type, const unsigned char *_data, size_t _size)
+{
+    unsigned char head[8];
+    put_be32(head, _size);
+    memcpy(head+4, _type, 4);
+    uLong crc = crc32(0, head+4, 4);
+    if(_size > 0)
+    {
+        crc = crc32(crc, _data, _size);
+    }
+    unsigned char tail[4];
+    put_be32(tail, crc);
+
+    out->write((const char *)head, 8);
+    out->write((const char *)_data, _size);
+    out->write((const char *)tail, 4);
+    failed = failed || !out->good();
+}
+
+void RowEncoder::deflate_rows(int _flush)
+{
+    for(;;)
+    {
+        int ret = deflate(&zs, _flush);
+        if(zs.avail_out == 0)
+        {
+            // a full chunk, there may be more output pending
+            write_chunk("IDAT", compressed.data(), compressed.size());
+            zs.next_out = compressed.data();
+            zs.avail_out = compressed.size();
+            continue;
+        }
+        if( (_flush != Z_FINISH) || (ret == Z_STREAM_END) || (ret == Z_STREAM_ERROR) )
+            break;
+    }
+    if( (_flush == Z_FINISH) && (zs.avail_out < compressed.size()) )
+    {
+        write_chunk("IDAT", compressed.data(), compressed.size() - zs.avail_out);
+    }
+}
+
+void RowEncoder::encode(const cv::Mat &_rows)
+{
+    int width = cols*channels;
+    for(int r=0; (r<_rows.rows) && (written<rows); r++, written++)
+    {
+        const unsigned char *p = _rows.ptr<unsigned char>(r);
+        if(format == "raw")
+        {
+            out->write((const char *)p, width);
+            continue;
+        }
+
+        // BGR(A) to RGB(A)
+        pixels.assign(p, p + width);
+        if(channels >= 3)
+        {
+            for(int k=0; k<width; k+=channels)
+            {
+                std::swap(pixels[k], pixels[k+2]);
+            }
+        }
+        if(format == "ppm")
+        {
+            out->write((const char *)pixels.data(), width);
+            continue;
+        }
+
+        // filter byte, then Sub (the difference to the pixel on the left) unless
+        // the data is only stored
+        line.resize(width+1);
+        line[0] = (level > 0) ? 1 : 0;
+        for(int k=0; k<width; k++)
+        {
+            line[k+1] = (level > 0) && (k >= channels) ? (unsigned char)(pixels[k] - pixels[k-channels]) : pixels[k];
+        }
+        zs.next_in = line.data();
+        zs.avail_in = line.size();
+        deflate_rows(Z_NO_FLUSH);
+    }
+    failed = failed || !out->good();
+}
@@ -0,0 +1,79 @@
+/*
+ * Streaming output encoder
+ *
+ * Encodes an image row band by row band on a worker thread, so the output
+ * of a synthesis can be written while its later tile rows are still being
+ * searched. Formats:
+ *   png   deflate level 0 (stored, fastest) to 9, rows filtered with Sub
+ *   ppm   uncompressed netpbm: P5 for gray, P6 for colour, P7 (PAM) with alpha
+ *   raw   the pixels as they are, BGR(A) interleaved without a header
+ *
+ *   RowEncoder encoder;
+ *   encoder.open(file, "png", size, size, channels, 1);
+ *   imagequilting.synthesize(src, res, params, encoder.follow(res, params));
+ *   encoder.close();
+ *
+ */
+
+#ifndef ROWENCODER_H
+#define ROWENCODER_H
+
+#include <string>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <ostream>
+#include <zlib.h>
+#include <imagequilting.h>
+
+class RowEncoder
+{
+public:
+    RowEncoder();
+    ~RowEncoder();
+
+    // the format written for a file name: png, ppm for .ppm/.pgm/.pam, raw for .raw, or empty
+    static std::string format_of(const std::string &_filename);
+
+    // start encoding a _rows X _cols image of 8-bit _channels into _out, which must
+    // stay open until close(); _level is the png compression level
+    bool open(std::ostream &_out, const std::string &_format, int _rows, int _cols, int _channels, int _level = 6);
+    // queue the next rows of the image, they are copied
+    void push(const cv::Mat &_rows);
+    // a progress callback for synthesize() that queues the rows of _image which no
+    // later tile row writes to anymore, then calls _next; _image must stay alive
+    QuiltProgress follow(const cv::Mat &_image, const QuiltParams &_params, QuiltProgress _next = QuiltProgress());
+    // wait until everything queued is written, false if writing failed or rows are missing
+    bool close();
+
+private:
+    void work();
+    void encode(const cv::Mat &_rows);
+    void write_header();
+    void write_chunk(const char *_type, const unsigned char *_data, size_t _size);
+    void deflate_rows(int _flush);
+
+    std::ostream *out;
+    std::string format;
+    int rows;
+    int cols;
+    int channels;
+    int level;
+    int queued;                 // rows pushed so far
+    int written;                // rows encoded so far
+    bool failed;
+
+    z_stream zs;
+    std::vector<unsigned char> pixels;      // the current row in RGB(A) order
+    std::vector<unsigned char> line;        // the same row as it is written
+    std::vector<unsigned char> compressed;  // deflate output, one IDAT chunk when full
+
+    std::queue<cv::Mat> bands;
+    bool closing;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::thread worker;
+};
+
+#endif // ROWENCODER_H
@@ -0,0 +1,25 @@
+# Python bindings of quiltcore, build with: python3 setup.py build_ext --inplace
+from setuptools import setup, Extension
+
+# same locations as opencv.pri
+OPENCV = '/usr/local/opencv-2-4-10'
+BOOST = '/home/kevin/research/texture/image_quilting/ext'
+
+quilt = Extension(
+    'quilt',
+    sources=['quiltpy.cpp', 'imagequilting.cpp', 'placementlog.cpp', 'checkpoint.cpp', 'rowencoder.cpp'],
+    depends=['imagequilting.h', 'kernels.h', 'placementlog.h', 'checkpoint.h', 'rowencoder.h'],
+    include_dirs=['.', BOOST, OPENCV + '/include'],
+    library_dirs=[OPENCV + '/lib'],
+    runtime_library_dirs=[OPENCV + '/lib'],
+    libraries=['opencv_core', 'opencv_highgui', 'opencv_imgproc', 'z'],
+    extra_compile_args=['-std=c++11'],
+    language='c++',
+)
+
+setup(
+    name='quilt',
+    version='1.0',
+    description='Image quilting texture synthesis',
+    ext_modules=[quilt],
+)